@@ -0,0 +1,135 @@
+#!/bin/bash
+
+# Sends SIGTERM to processes that are busy sending and delivering, then checks
+# that every process exits in time and leaves a complete output file: no
+# half-written line, nothing but well-formed lines and, for FIFO broadcast,
+# no delivery of a message its sender did not log as broadcast.
+#
+# Usage: sigterm_under_load.sh [perfect|fifo|lattice] [processes] [seconds]
+# The binary is ../bin/da_proc unless DA_PROC names another one.
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+
+KIND=${1:-fifo}
+N=${2:-5}
+DELAY=${3:-1}
+BIN=${DA_PROC:-"$DIR"/../bin/da_proc}
+# How long the processes get to start logging, and to exit once signaled.
+START_TIMEOUT=30
+EXIT_TIMEOUT=5
+
+if [ ! -x "$BIN" ]; then
+  echo "No executable at $BIN, build it or set DA_PROC" >&2
+  exit 2
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+: > "$WORK"/hosts
+for i in $(seq 1 "$N"); do
+  echo "$i localhost $((12000 + i))" >> "$WORK"/hosts
+done
+
+# Far more work than fits in DELAY seconds, so the signal finds them busy.
+case "$KIND" in
+  perfect)
+    echo "100000000 1" > "$WORK"/config
+    LINE='^[bd] [0-9]+( [0-9]+)?$'
+    ;;
+  fifo)
+    echo "100000000" > "$WORK"/config
+    LINE='^(b [0-9]+|d [0-9]+ [0-9]+)$'
+    ;;
+  lattice)
+    awk -v p=100000 -v vs=10 -v ds=50 'BEGIN {
+      srand(1); print p, vs, ds
+      for (s = 0; s < p; s++) {
+        line = int(rand() * ds)
+        for (v = 1; v < vs; v++) line = line " " int(rand() * ds)
+        print line
+      }
+    }' > "$WORK"/config
+    LINE='^[0-9]+( [0-9]+)*$'
+    ;;
+  *)
+    echo "Unknown kind $KIND, expected perfect, fifo or lattice" >&2
+    exit 2
+    ;;
+esac
+
+pids=()
+for i in $(seq 1 "$N"); do
+  "$BIN" --id "$i" --hosts "$WORK"/hosts --output "$WORK"/$i.output "$WORK"/config \
+      > "$WORK"/$i.stdout 2> "$WORK"/$i.stderr &
+  pids+=($!)
+done
+
+# Reading a large config takes a while, the delay counts from the first
+# lines of the last process to start logging.
+deadline=$(( $(date +%s) + START_TIMEOUT ))
+for i in $(seq 1 "$N"); do
+  while [ ! -s "$WORK"/$i.output ] && [ "$(date +%s)" -lt "$deadline" ]; do
+    sleep 0.05
+  done
+done
+sleep "$DELAY"
+kill -TERM "${pids[@]}"
+
+ret=0
+deadline=$(( $(date +%s) + EXIT_TIMEOUT ))
+for i in $(seq 1 "$N"); do
+  pid=${pids[$((i - 1))]}
+  while kill -0 "$pid" 2>/dev/null && [ "$(date +%s)" -lt "$deadline" ]; do
+    sleep 0.05
+  done
+  if kill -0 "$pid" 2>/dev/null; then
+    echo "Process $i still running $EXIT_TIMEOUT s after SIGTERM" >&2
+    kill -KILL "$pid"
+    ret=1
+  fi
+  wait "$pid"
+  status=$?
+  if [ "$status" -ne 0 ] && [ "$ret" -eq 0 ]; then
+    echo "Process $i exited with status $status" >&2
+    ret=1
+  fi
+done
+
+for i in $(seq 1 "$N"); do
+  out="$WORK"/$i.output
+  if [ ! -s "$out" ]; then
+    echo "Process $i logged nothing" >&2
+    ret=1
+    continue
+  fi
+  if [ "$(tail -c 1 "$out" | od -An -c | tr -d ' ')" != '\n' ]; then
+    echo "Output of process $i ends with a partial line" >&2
+    ret=1
+  fi
+  bad=$(grep -cvE "$LINE" "$out")
+  if [ "$bad" -ne 0 ]; then
+    echo "Output of process $i has $bad malformed lines" >&2
+    ret=1
+  fi
+  echo "Process $i: $(wc -l < "$out") lines"
+done
+
+if [ "$KIND" = fifo ]; then
+  # Every "d <sender> <m>" needs a "b <m>" in the sender's output.
+  for i in $(seq 1 "$N"); do
+    missing=$(awk -v sender="$i" '
+      FNR == NR { if ($1 == "b") broadcast[$2] = 1; next }
+      $1 == "d" && $2 == sender && !($3 in broadcast) { n++ }
+      END { print n + 0 }' "$WORK"/$i.output "$WORK"/*.output)
+    if [ "$missing" -ne 0 ]; then
+      echo "$missing deliveries from process $i were not logged as broadcast" >&2
+      ret=1
+    fi
+  done
+fi
+
+if [ "$ret" -eq 0 ]; then
+  echo "OK"
+fi
+exit $ret
@@ -0,0 +1,138 @@
+// Contention on the delivered set: 8 threads mark packets from 127 senders,
+// every packet twice as if retransmitted, shuffled within blocks of 256 ids
+// per sender. Compares the per-sender DeliveredWindow with the single
+// mutex-guarded unordered_set it replaced. Every packet must be delivered
+// exactly once, and every window must end with its watermark at the last id.
+// Usage: delivered_window_bench [packets per sender]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "delivered_window.hpp"
+
+constexpr static uint32_t THREADS = 8;
+constexpr static uint32_t SENDERS = 127;
+constexpr static uint32_t SHUFFLE_BLOCK = 256;
+// Events a thread claims at once.
+constexpr static size_t CLAIM = 64;
+
+struct Event {
+    uint32_t sender;
+    uint32_t seq_id;
+};
+
+struct PairHash {
+    size_t operator()(const std::pair<uint64_t, uint32_t>& key) const noexcept {
+      return std::hash<uint64_t>()(key.first << 32 | key.second);
+    }
+};
+
+// The delivered set before DeliveredWindow.
+class MutexSet {
+private:
+    std::mutex _mutex;
+    std::unordered_set<std::pair<uint64_t, uint32_t>, PairHash> _delivered;
+
+public:
+    bool mark(uint32_t sender, uint32_t seq_id) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _delivered.insert({sender, seq_id}).second;
+    }
+    size_t size() const {
+      return _delivered.size();
+    }
+};
+
+static std::vector<Event> make_events(uint32_t packets) {
+  std::vector<Event> events;
+  std::mt19937 rng(1);
+  for (uint32_t first = 1; first <= packets; first += SHUFFLE_BLOCK) {
+    uint32_t end = std::min(first + SHUFFLE_BLOCK, packets + 1);
+    size_t block_begin = events.size();
+    for (uint32_t sender = 0; sender < SENDERS; sender++) {
+      for (uint32_t seq_id = first; seq_id < end; seq_id++) {
+        events.push_back({sender, seq_id});
+        events.push_back({sender, seq_id});
+      }
+    }
+    std::shuffle(events.begin() + static_cast<std::ptrdiff_t>(block_begin), events.end(), rng);
+  }
+  return events;
+}
+
+// Runs mark(event) for every event on THREADS threads, returns the number it
+// returned true for and sets ms to the wall time.
+template <typename F>
+static uint64_t run(const std::vector<Event>& events, F&& mark, double& ms) {
+  std::atomic<size_t> cursor{0};
+  std::atomic<uint64_t> delivered{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < THREADS; t++) {
+    threads.emplace_back([&] {
+      uint64_t local = 0;
+      for (size_t begin = cursor.fetch_add(CLAIM); begin < events.size(); begin = cursor.fetch_add(CLAIM)) {
+        size_t end = std::min(begin + CLAIM, events.size());
+        for (size_t i = begin; i < end; i++) {
+          local += mark(events[i]) ? 1 : 0;
+        }
+      }
+      delivered.fetch_add(local);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  return delivered.load();
+}
+
+int main(int argc, char **argv) {
+  uint32_t packets = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 8000;
+  std::vector<Event> events = make_events(packets);
+  uint64_t expected = static_cast<uint64_t>(SENDERS) * packets;
+  bool ok = true;
+
+  MutexSet set;
+  double set_ms;
+  uint64_t set_delivered = run(events, [&set](const Event& e) {
+    return set.mark(e.sender, e.seq_id);
+  }, set_ms);
+  bool set_ok = set_delivered == expected && set.size() == expected;
+  ok &= set_ok;
+
+  std::vector<DeliveredWindow> windows(SENDERS);
+  double window_ms;
+  uint64_t window_delivered = run(events, [&windows](const Event& e) {
+    MarkResult result;
+    // The id is ahead of what the window covers until other threads fill
+    // the gap below it, as the link would retransmit it later.
+    while ((result = windows[e.sender].mark(e.seq_id)) == MarkResult::OUT_OF_WINDOW) {
+      std::this_thread::yield();
+    }
+    return result == MarkResult::DELIVER;
+  }, window_ms);
+  bool window_ok = window_delivered == expected;
+  for (const DeliveredWindow& window : windows) {
+    window_ok &= window.watermark() == packets;
+  }
+  ok &= window_ok;
+
+  double mops = static_cast<double>(events.size()) / 1000.0;
+  std::printf("%u threads, %u senders, %zu marks\n", THREADS, SENDERS, events.size());
+  std::printf("%-20s %8.1f ms %6.1f Mmarks/s  %llu delivered  %zu set nodes%s\n", "mutex+unordered_set",
+              set_ms, mops / set_ms, static_cast<unsigned long long>(set_delivered), set.size(),
+              set_ok ? "" : "  MISMATCH");
+  std::printf("%-20s %8.1f ms %6.1f Mmarks/s  %llu delivered  %zu window bytes%s\n", "DeliveredWindow",
+              window_ms, mops / window_ms, static_cast<unsigned long long>(window_delivered),
+              sizeof(DeliveredWindow) * SENDERS, window_ok ? "" : "  MISMATCH");
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,225 @@
+// Checks IntSet against std::set on random sets, sparse and dense, then
+// times the acceptor step of lattice agreement, an inclusion test and a
+// union, against the sorted vectors proposals used to be. Built once per
+// word operation level, INT_SET_MAX_WORD_OPS, so that the AVX2, SSE2 and
+// scalar paths all get checked on a CPU that has AVX2.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <random>
+#include <set>
+#include <vector>
+#include "int_set.hpp"
+#include "lattice_agreement.hpp"
+
+#ifndef INT_SET_MAX_WORD_OPS
+#define INT_SET_MAX_WORD_OPS 2
+#endif
+
+constexpr static uint32_t CHECKS = 200000;
+constexpr static uint32_t MALFORMED_CHECKS = 100000;
+// Proposals the timed acceptor goes through, round robin.
+constexpr static size_t PROPOSALS = 64;
+
+// mt19937 results are 32 bits wide, in a wider type.
+static uint32_t next_value(std::mt19937& rng) {
+  return static_cast<uint32_t>(rng());
+}
+
+static IntSet make_set(const std::set<uint32_t>& values) {
+  return IntSet(std::vector<uint32_t>(values.begin(), values.end()));
+}
+
+static bool same(const IntSet& set, const std::set<uint32_t>& expected) {
+  return set.size() == expected.size() &&
+         set.values() == std::vector<uint32_t>(expected.begin(), expected.end());
+}
+
+// Up to 300 values out of a range picked by kind: a single word, small and
+// large dense ranges, the whole uint32_t range, and both of its ends.
+static std::set<uint32_t> random_values(std::mt19937& rng, uint32_t kind) {
+  std::set<uint32_t> values;
+  uint32_t range = 5000;
+  uint32_t offset = 0;
+  switch (kind) {
+    case 0:
+      range = 64;
+      break;
+    case 1:
+      range = 1000;
+      break;
+    case 2:
+      range = 100000;
+      break;
+    case 3:
+      range = UINT32_MAX;
+      break;
+    default:
+      offset = next_value(rng) % 2 == 0 ? 0 : UINT32_MAX - 6000;
+      break;
+  }
+  uint32_t n = next_value(rng) % 300;
+  for (uint32_t i = 0; i < n; i++) {
+    values.insert(offset + next_value(rng) % range);
+  }
+  return values;
+}
+
+// Whether set encodes into chunks of at most chunk_size bytes that decode
+// back to it.
+static bool round_trips(const IntSet& set, const std::set<uint32_t>& expected, size_t chunk_size) {
+  std::vector<uint8_t> out;
+  std::vector<size_t> ends;
+  set.encode_chunks(chunk_size, out, ends);
+  IntSet decoded;
+  size_t begin = 0;
+  for (size_t end : ends) {
+    if (end - begin > chunk_size || decoded.decode_chunk(out.data() + begin, end - begin) != end - begin) {
+      return false;
+    }
+    begin = end;
+  }
+  return begin == out.size() && same(decoded, expected);
+}
+
+static bool check(std::mt19937& rng, uint32_t kind) {
+  std::set<uint32_t> a = random_values(rng, kind);
+  std::set<uint32_t> b = random_values(rng, kind);
+  if (next_value(rng) % 4 == 0) {
+    b.insert(a.begin(), a.end());
+  }
+  IntSet set_a = make_set(a);
+  IntSet set_b = make_set(b);
+  if (!same(set_a, a) || !same(set_b, b)) {
+    return false;
+  }
+  if (set_a.includes(set_b) != std::includes(a.begin(), a.end(), b.begin(), b.end())) {
+    return false;
+  }
+  for (uint32_t i = 0; i < 5; i++) {
+    uint32_t value = a.empty() || next_value(rng) % 2 == 0 ? next_value(rng) : *a.begin() + next_value(rng) % 1000;
+    if (set_a.contains(value) != (a.count(value) == 1)) {
+      return false;
+    }
+  }
+  if (!round_trips(set_a, a, MIN_SET_CHUNK_SIZE + next_value(rng) % 1500)) {
+    return false;
+  }
+
+  std::set<uint32_t> difference;
+  std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::inserter(difference, difference.end()));
+  if (!same(set_a.difference(set_b), difference)) {
+    return false;
+  }
+
+  // merge appends to added, after what it already holds.
+  std::vector<uint32_t> expected_added{7};
+  std::set_difference(b.begin(), b.end(), a.begin(), a.end(), std::back_inserter(expected_added));
+  std::vector<uint32_t> added{7};
+  bool grew = set_a.merge(set_b, &added);
+  std::set<uint32_t> both = a;
+  both.insert(b.begin(), b.end());
+  return grew == (both.size() > a.size()) && added == expected_added && same(set_a, both) &&
+         set_a.includes(set_b) && set_a.includes(make_set(a));
+}
+
+// Random bytes must decode to a failure or to some set, never crash.
+static void decode_malformed(std::mt19937& rng) {
+  uint8_t junk[64];
+  for (uint32_t i = 0; i < MALFORMED_CHECKS; i++) {
+    for (uint8_t& byte : junk) {
+      byte = static_cast<uint8_t>(next_value(rng));
+    }
+    junk[0] &= 1;
+    IntSet set;
+    set.decode_chunk(junk, next_value(rng) % sizeof(junk));
+  }
+}
+
+using Clock = std::chrono::steady_clock;
+
+// Times an acceptor going through the proposals: it acks a proposal that
+// includes what it accepted, and accepts the union either way. Both stores
+// must ack the same proposals.
+static bool bench_acceptor(std::mt19937& rng, bool sparse, uint32_t ds) {
+  uint32_t vs = ds / 2;
+  std::vector<uint32_t> domain(ds);
+  for (uint32_t i = 0; i < ds; i++) {
+    domain[i] = sparse ? next_value(rng) >> 1 : 1000 + i;
+  }
+  std::vector<std::vector<uint32_t>> vectors(PROPOSALS);
+  std::vector<IntSet> sets;
+  for (std::vector<uint32_t>& proposal : vectors) {
+    std::sample(domain.begin(), domain.end(), std::back_inserter(proposal), vs, rng);
+    std::sort(proposal.begin(), proposal.end());
+    proposal.erase(std::unique(proposal.begin(), proposal.end()), proposal.end());
+    sets.emplace_back(proposal);
+  }
+
+  uint32_t reps = std::max<uint32_t>(1, 2000000 / ds);
+  size_t vector_acks = 0;
+  size_t set_acks = 0;
+  auto start = Clock::now();
+  for (uint32_t r = 0; r < reps; r++) {
+    std::vector<uint32_t> accepted;
+    for (size_t i = 0; i < PROPOSALS; i++) {
+      const std::vector<uint32_t>& proposal = vectors[(i + r) % PROPOSALS];
+      if (std::includes(proposal.begin(), proposal.end(), accepted.begin(), accepted.end())) {
+        vector_acks++;
+        accepted = proposal;
+        continue;
+      }
+      std::vector<uint32_t> merged;
+      merged.reserve(accepted.size() + proposal.size());
+      std::set_union(accepted.begin(), accepted.end(), proposal.begin(), proposal.end(),
+                     std::back_inserter(merged));
+      accepted = std::move(merged);
+    }
+  }
+  auto middle = Clock::now();
+  for (uint32_t r = 0; r < reps; r++) {
+    IntSet accepted;
+    for (size_t i = 0; i < PROPOSALS; i++) {
+      const IntSet& proposal = sets[(i + r) % PROPOSALS];
+      if (proposal.includes(accepted)) {
+        set_acks++;
+      }
+      accepted.merge(proposal);
+    }
+  }
+  auto end = Clock::now();
+
+  std::vector<uint8_t> out;
+  std::vector<size_t> ends;
+  sets[0].encode_chunks(LATTICE_PACKET_SIZE, out, ends);
+  double steps = static_cast<double>(reps) * PROPOSALS;
+  double vector_ns = std::chrono::duration<double, std::nano>(middle - start).count() / steps;
+  double set_ns = std::chrono::duration<double, std::nano>(end - middle).count() / steps;
+  bool ok = vector_acks == set_acks;
+  std::printf("%-6s %6u %6u  %9.0f ns %9.0f ns  x%5.1f  %-6s %7zu B in %3zu chunks%s\n", sparse ? "sparse" : "dense",
+              ds, vs, vector_ns, set_ns, vector_ns / set_ns, sets[0].dense() ? "bitmap" : "vector", out.size(),
+              ends.size(), ok ? "" : "  MISMATCH");
+  return ok;
+}
+
+int main() {
+  static const char *const levels[] = {"scalar", "SSE2", "AVX2"};
+  std::printf("Word operations: %s at most\n", levels[INT_SET_MAX_WORD_OPS]);
+  std::mt19937 rng(42);
+  bool ok = true;
+  for (uint32_t i = 0; i < CHECKS && ok; i++) {
+    ok = check(rng, i % 5);
+  }
+  decode_malformed(rng);
+  std::printf("%u random sets against std::set: %s\n", CHECKS, ok ? "same" : "MISMATCH");
+
+  std::printf("%-6s %6s %6s  %12s %12s  %6s  %s\n", "values", "ds", "vs", "vector", "IntSet", "", "first proposal, in lattice packets");
+  for (bool sparse : {false, true}) {
+    for (uint32_t ds : {64u, 1024u, 16384u, 65536u}) {
+      ok &= bench_acceptor(rng, sparse, ds);
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
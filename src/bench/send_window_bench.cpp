@@ -0,0 +1,140 @@
+// Insert, ack and scan throughput of the ring-buffer SendWindow against the
+// std::set of packets with heap payloads it replaced, at window sizes from
+// 32 to 4096. A round fills the window, scans it as the retransmit loop does,
+// acks every other packet, scans again and acks the rest. Both stores must
+// see the same packets at every step.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <vector>
+#include "send_window.hpp"
+
+// Packets pushed per window size, whatever the size.
+constexpr static uint32_t PACKETS = 1 << 21;
+constexpr static size_t DATA_SIZE = 32;
+
+// The unacked store before SendWindow: ordered by sequence id, searchable by
+// it alone.
+struct UnackedPacket {
+    uint32_t seq_id;
+    std::vector<uint8_t> data;
+};
+
+struct UnackedLess {
+    using is_transparent = void;
+
+    bool operator()(const UnackedPacket& lhs, const UnackedPacket& rhs) const {
+      return lhs.seq_id < rhs.seq_id;
+    }
+    bool operator()(const UnackedPacket& lhs, uint32_t rhs) const {
+      return lhs.seq_id < rhs;
+    }
+    bool operator()(uint32_t lhs, const UnackedPacket& rhs) const {
+      return lhs < rhs.seq_id;
+    }
+};
+
+// Nanoseconds spent in each step, and checksums of what the scans saw.
+struct Timings {
+    double insert{0};
+    double ack{0};
+    double scan{0};
+    uint64_t scanned{0};
+    uint64_t acked{0};
+};
+
+using Clock = std::chrono::steady_clock;
+
+static double ns_since(Clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static Timings bench_set(uint32_t window) {
+  Timings t;
+  std::set<UnackedPacket, UnackedLess> unacked;
+  std::vector<uint8_t> payload(DATA_SIZE, 0x5A);
+  uint32_t next = 1;
+  for (uint32_t round = 0; round < PACKETS / window; round++) {
+    uint32_t first = next;
+    auto start = Clock::now();
+    for (uint32_t i = 0; i < window; i++) {
+      unacked.insert({next++, payload});
+    }
+    t.insert += ns_since(start);
+
+    for (uint32_t parity = 1; parity <= 2; parity++) {
+      start = Clock::now();
+      for (const UnackedPacket& packet : unacked) {
+        t.scanned += packet.seq_id + packet.data[0];
+      }
+      t.scan += ns_since(start);
+
+      start = Clock::now();
+      for (uint32_t seq_id = first + parity % 2; seq_id < next; seq_id += 2) {
+        auto it = unacked.find(seq_id);
+        if (it != unacked.end()) {
+          unacked.erase(it);
+          t.acked++;
+        }
+      }
+      t.ack += ns_since(start);
+    }
+  }
+  return t;
+}
+
+static Timings bench_window(uint32_t window) {
+  Timings t;
+  SendWindow unacked(window, DATA_SIZE, 1);
+  std::vector<uint8_t> payload(DATA_SIZE, 0x5A);
+  for (uint32_t round = 0; round < PACKETS / window; round++) {
+    uint32_t first = unacked.next();
+    auto start = Clock::now();
+    for (uint32_t i = 0; i < window; i++) {
+      std::memcpy(unacked.push(DATA_SIZE), payload.data(), DATA_SIZE);
+    }
+    t.insert += ns_since(start);
+    uint32_t next = unacked.next();
+
+    for (uint32_t parity = 1; parity <= 2; parity++) {
+      start = Clock::now();
+      for (uint32_t seq_id = unacked.base(); seq_id != unacked.next(); seq_id++) {
+        if (unacked.in_flight(seq_id)) {
+          t.scanned += seq_id + unacked.data(seq_id)[0];
+        }
+      }
+      t.scan += ns_since(start);
+
+      start = Clock::now();
+      AckSample sample;
+      for (uint32_t seq_id = first + parity % 2; seq_id < next; seq_id += 2) {
+        t.acked += unacked.ack(seq_id, sample) ? 1 : 0;
+      }
+      t.ack += ns_since(start);
+    }
+  }
+  return t;
+}
+
+int main() {
+  bool ok = true;
+  std::printf("%6s  %-10s %9s %9s %9s\n", "window", "store", "insert", "ack", "scan");
+  for (uint32_t window = 32; window <= 4096; window *= 2) {
+    Timings set = bench_set(window);
+    Timings ring = bench_window(window);
+    // Scans see every packet once before the first acks and half of them
+    // before the second.
+    double per_packet = static_cast<double>(PACKETS / window * window);
+    double per_scanned = per_packet * 1.5;
+    bool same = set.scanned == ring.scanned && set.acked == ring.acked &&
+                set.acked == static_cast<uint64_t>(per_packet);
+    ok &= same;
+    std::printf("%6u  %-10s %6.1f ns %6.1f ns %6.1f ns\n", window, "std::set", set.insert / per_packet,
+                set.ack / per_packet, set.scan / per_scanned);
+    std::printf("%6u  %-10s %6.1f ns %6.1f ns %6.1f ns%s\n", window, "SendWindow", ring.insert / per_packet,
+                ring.ack / per_packet, ring.scan / per_scanned, same ? "" : "  MISMATCH");
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
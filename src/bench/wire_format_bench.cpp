@@ -0,0 +1,60 @@
+// Bytes on the wire and encode/decode time per packet, LEGACY headers against
+// COMPACT ones, for a DATA packet of 8 messages and for an ACK. Every decoded
+// packet is checked against what was encoded.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "packet.hpp"
+
+constexpr static uint32_t ROUNDS = 2000000;
+constexpr static uint32_t MESSAGES = 8;
+
+static double ns_per_round(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ROUNDS;
+}
+
+// Returns false if a packet did not decode to what was encoded.
+static bool bench(WireFormat format, PacketType type) {
+  std::vector<uint8_t> payload(type == PacketType::DATA ? MESSAGES * sizeof(uint32_t) : 0, 0x5A);
+  PacketHeader header{17, type, 0, static_cast<uint32_t>(payload.size())};
+  // One slot per packet, so that timing covers encoding and not allocation.
+  constexpr size_t slot = HEADER_SIZE + MESSAGES * sizeof(uint32_t);
+  std::vector<uint8_t> packets(ROUNDS * slot);
+  std::vector<size_t> sizes(ROUNDS);
+
+  size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < ROUNDS; i++) {
+    header.seq_id = i * MESSAGES + 1;
+    sizes[i] = PacketView::encode(packets.data() + i * slot, slot, header, payload.data(), format);
+    bytes += sizes[i];
+  }
+  double encode_ns = ns_per_round(start);
+
+  bool ok = true;
+  PacketView view;
+  start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < ROUNDS; i++) {
+    ok &= view.decode(packets.data() + i * slot, sizes[i]) && view.pid() == header.pid &&
+          view.packet_type() == type && view.seq_id() == i * MESSAGES + 1 &&
+          view.data_size() == payload.size();
+  }
+  double decode_ns = ns_per_round(start);
+
+  std::printf("%-7s %-4s %6.1f bytes %6.1f ns encode %6.1f ns decode%s\n",
+              format == WireFormat::LEGACY ? "legacy" : "compact", type == PacketType::DATA ? "DATA" : "ACK",
+              static_cast<double>(bytes) / ROUNDS, encode_ns, decode_ns, ok ? "" : "  MISMATCH");
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+  for (WireFormat format : {WireFormat::LEGACY, WireFormat::COMPACT}) {
+    for (PacketType type : {PacketType::DATA, PacketType::ACK}) {
+      ok &= bench(format, type);
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
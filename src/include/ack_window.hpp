@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Number of sequence ids above the cumulative ACK that can be tracked out of
+// order. Must cover the sender's sliding window.
+constexpr static uint32_t SACK_WINDOW_BITS = 1024;
+constexpr static size_t MAX_SACK_BITMAP_SIZE = SACK_WINDOW_BITS / 8;
+
+// Receiver-side record of the DATA sequence ids seen on a link. Everything
+// below cumulative() has been received; above it a ring bitmap indexed by
+// seq_id % SACK_WINDOW_BITS remembers the ids that arrived out of order.
+class AckWindow {
+private:
+    uint32_t _cumulative;
+    uint32_t _highest;
+    std::array<uint64_t, SACK_WINDOW_BITS / 64> _bits{};
+
+    bool test(uint32_t seq_id) const;
+    void set(uint32_t seq_id);
+    void clear(uint32_t seq_id);
+
+public:
+    explicit AckWindow(uint32_t first_seq_id);
+
+    bool mark(uint32_t seq_id);
+    uint32_t cumulative() const;
+    size_t encode_bitmap(uint8_t *buffer, size_t capacity) const;
+};
+
+// Calls f(seq_id) for every sequence id flagged in a SACK bitmap. Bit i of the
+// bitmap (LSB first) stands for cumulative + 1 + i.
+template <typename F>
+void for_each_sacked(uint32_t cumulative, const uint8_t *bitmap, size_t size, F f) {
+  for (size_t byte = 0; byte < size; byte++) {
+    unsigned int bits = bitmap[byte];
+    while (bits != 0) {
+      auto bit = static_cast<uint32_t>(__builtin_ctz(bits));
+      f(cumulative + 1 + static_cast<uint32_t>(byte * 8) + bit);
+      bits &= bits - 1;
+    }
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Threads with a cache of their own, later ones share the common list.
+constexpr static size_t MAX_POOL_THREADS = 64;
+// Buffers moved between a thread cache and the shared list at once.
+constexpr static size_t POOL_BATCH = 8;
+// A thread cache holding more than this spills a batch to the shared list.
+constexpr static size_t POOL_CACHE_LIMIT = 2 * POOL_BATCH;
+
+struct BufferPoolStats {
+    // Buffers handed out by take().
+    uint64_t takes;
+    // take() calls that had to go to the heap.
+    uint64_t heap_allocs;
+    // Batches a thread took from the shared list.
+    uint64_t refills;
+};
+
+// Fixed-size buffers recycled through per-thread caches. A thread takes and
+// gives buffers from its own cache without synchronization; a full cache
+// spills a batch to a shared list under a mutex, an empty one refills from
+// it, and only then does take() allocate. Buffers are never returned to the
+// heap before the pool is destroyed, so once the pool has grown to the number
+// of buffers in flight, taking one costs no malloc. A thread keeps a cache
+// for the last pool it used only, meant for a pool or two per process.
+class BufferPool {
+private:
+    struct Buffer {
+        Buffer *next;
+    };
+
+    struct ThreadCache {
+        Buffer *head{nullptr};
+        size_t count{0};
+        // Read by stats() from other threads.
+        std::atomic<uint64_t> takes{0};
+    };
+
+    const size_t _buffer_size;
+    // Tells thread caches of a destroyed pool apart from those of a new one
+    // at the same address.
+    const uint64_t _id;
+    std::array<std::atomic<ThreadCache *>, MAX_POOL_THREADS> _caches{};
+    std::atomic<size_t> _n_caches{0};
+    std::mutex _shared_mutex;
+    Buffer *_shared{nullptr};
+    std::atomic<uint64_t> _shared_takes{0};
+    std::atomic<uint64_t> _heap_allocs{0};
+    std::atomic<uint64_t> _refills{0};
+
+    ThreadCache *thread_cache();
+    void refill(ThreadCache *cache);
+    void spill(ThreadCache *cache);
+    void *allocate();
+    static void free_list(Buffer *buffers);
+
+public:
+    explicit BufferPool(size_t buffer_size);
+    ~BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Uninitialized, buffer_size bytes, aligned for any scalar type.
+    void *take();
+    // Any thread may give back a buffer taken by another.
+    void give(void *buffer);
+    size_t buffer_size() const;
+    BufferPoolStats stats() const;
+};
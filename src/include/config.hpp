@@ -1,14 +1,46 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <vector>
+
+// Which milestone the config file is for, told apart by the number of values
+// on its first line.
+enum class ConfigKind {
+    // "m i"
+    PERFECT_LINKS,
+    // "m"
+    FIFO_BROADCAST,
+    // "p vs ds", then one line of values per proposal
+    LATTICE_AGREEMENT
+};
 
 class Config {
 private:
+    ConfigKind _kind;
     uint32_t _num_messages;
     uint32_t _receiver_proc;
+    uint32_t _max_values;
+    uint32_t _max_distinct;
+    // Lattice agreement: the values of every proposal back to back, proposal i
+    // from _offsets[i] to _offsets[i + 1].
+    std::vector<uint32_t> _values;
+    std::vector<size_t> _offsets{0};
 
 public:
     Config(uint32_t num_messages, uint32_t receiver_proc);
+    explicit Config(uint32_t num_messages);
+    Config(uint32_t n_proposals, uint32_t max_values, uint32_t max_distinct);
+    ConfigKind kind() const;
     uint32_t num_messages() const;
+    // Perfect links only.
     uint32_t receiver_proc() const;
+
+    // Lattice agreement only. Proposals are added in shot order, sorted and
+    // without duplicates.
+    void add_proposal(std::vector<uint32_t> values);
+    uint32_t n_proposals() const;
+    uint32_t max_values() const;
+    uint32_t max_distinct() const;
+    std::vector<uint32_t> proposal(uint32_t shot) const;
 };
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+
+// AIMD congestion window, counted in packets. Slow start doubles the window
+// every round trip up to ssthresh, congestion avoidance then adds one packet
+// per window's worth of ACKs. A loss shrinks the window by a factor of 0.7,
+// at most once per window of data. The usable window is further capped by
+// what the receiver advertises in its SACKs.
+class CongestionWindow {
+public:
+    constexpr static uint32_t INITIAL_CWND = 32;
+    constexpr static uint32_t MIN_CWND = 16;
+
+    explicit CongestionWindow(uint32_t max_cwnd);
+
+    void on_ack(uint32_t acked);
+    void on_loss(uint32_t seq_id, uint32_t next_seq_id);
+    void set_receiver_window(uint32_t rwnd);
+    uint32_t cwnd() const;
+    uint32_t window() const;
+
+private:
+    uint32_t _max_cwnd;
+    uint32_t _cwnd;
+    uint32_t _ssthresh;
+    uint32_t _acked_in_round{0};
+    uint32_t _rwnd;
+    // Losses of packets sent before the last decrease belong to the same
+    // congestion event and do not shrink the window again.
+    uint32_t _recovery_point{0};
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Sequence ids above the watermark that can be delivered out of order. Must
+// cover the sender's sliding window.
+constexpr static uint32_t DELIVERED_WINDOW_BITS = 2048;
+constexpr static uint32_t DELIVERED_WORD_BITS = 32;
+constexpr static size_t DELIVERED_WINDOW_WORDS = DELIVERED_WINDOW_BITS / DELIVERED_WORD_BITS;
+
+enum class MarkResult {DELIVER, DUPLICATE, OUT_OF_WINDOW};
+
+// Lock-free record of the sequence ids delivered from one sender. Everything
+// up to watermark() has been delivered; above it a ring of tagged words holds
+// the ids that arrived out of order. Every word packs the index of the
+// 32-id block it currently describes next to the block's bitmap, so a slot is
+// taken over by a later block without ever being cleared.
+class DeliveredWindow {
+private:
+    std::atomic<uint32_t> _watermark{0};
+    // Zeroed words describe block 0, which starts out empty: seq_id 0 is
+    // never sent.
+    std::array<std::atomic<uint64_t>, DELIVERED_WINDOW_WORDS> _words{};
+
+    bool test(uint32_t seq_id) const;
+    void advance();
+
+public:
+    MarkResult mark(uint32_t seq_id);
+    uint32_t watermark() const;
+};
@@ -5,26 +5,81 @@
 #include <functional>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <csignal>
+#include <sys/socket.h>
+#include "io_uring.hpp"
 
 #define MAX_EVENTS 100
 
+class ReadEventHandler;
+
 struct EventData {
     int fd;
     void *handler_obj;
 };
 
+enum class EventLoopMode {
+    // All workers wait on one epoll instance. Every fd is registered with
+    // EPOLLONESHOT and rearmed after each event.
+    SHARED_ONESHOT,
+    // Every worker owns an epoll instance. Each fd is registered once with
+    // EPOLLET in the instance of a single worker, round robin.
+    PER_THREAD_EDGE,
+    // A single worker drives multishot recvmsg on every fd through io_uring,
+    // with receive buffers provided to the kernel up front. Falls back to
+    // PER_THREAD_EDGE when the kernel cannot do that.
+    IO_URING,
+};
+
+struct EventLoopStats {
+    // epoll_wait() or io_uring_enter() calls.
+    uint64_t waits;
+    uint64_t rearms;
+};
+
 class EventLoop {
 private:
-    int _epoll_fd;
+    EventLoopMode _mode;
+    // One instance in shared mode, one per worker otherwise.
+    std::vector<int> _epoll_fds;
     int _exit_loop_fd;
     std::atomic<bool> _running;
     EventData _exit_loop_data{};
+    // signalfd of watch_signals(), -1 if none.
+    EventData _signal_data{-1, nullptr};
+    std::function<void(int)> _on_signal;
+    size_t _next_owner{0};
+    std::atomic<size_t> _next_worker{0};
+    // Callers of run() left without an epoll instance wait here for stop().
+    std::mutex _idle_mutex;
+    std::condition_variable _idle_cv;
+    std::atomic<uint64_t> _waits{0};
+    std::atomic<uint64_t> _rearms{0};
+    // IO_URING mode only.
+    std::unique_ptr<IoUring> _uring;
+    struct msghdr _uring_recv_msg{};
+    std::vector<ReadEventHandler *> _uring_batch_handlers;
+
+    void register_fd(int epoll_fd, uint32_t events, EventData *event_data) const;
+    void run_instance(int epoll_fd);
+    void run_uring();
+    void uring_arm_recv(EventData *event_data);
+    void uring_arm_poll(EventData *event_data);
+    void handle_signals();
+    void uring_complete(const struct io_uring_cqe& cqe);
+    struct io_uring_sqe *uring_sqe();
 
 public:
-    EventLoop();
+    explicit EventLoop(EventLoopMode mode = EventLoopMode::SHARED_ONESHOT, size_t n_workers = 1);
     ~EventLoop();
-    void add(uint32_t events, EventData *event_data) const;
-    void rearm(uint32_t event, EventData *event_data) const;
+    void add(uint32_t events, EventData *event_data);
+    void rearm(uint32_t event, EventData *event_data);
+    void watch_signals(const sigset_t& signals, std::function<void(int)> on_signal);
     void run();
     void stop();
+    EventLoopMode mode() const;
+    EventLoopStats stats() const;
 };
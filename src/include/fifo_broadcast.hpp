@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "parser.hpp"
+#include "perfect_link.hpp"
+#include "log_writer.hpp"
+
+// Messages of one origin held between their first copy and their delivery.
+// Relays further ahead are refused and retransmitted by the link later, which
+// bounds the pending buffers whatever the number of processes.
+constexpr static uint32_t PENDING_WINDOW = 1024;
+// Own messages broadcast ahead of the oldest one not delivered yet. Half the
+// pending window, so peers somewhat behind still take them.
+constexpr static uint32_t BROADCAST_WINDOW = PENDING_WINDOW / 2;
+// Messages of other origins are relayed to a peer whose ack vector does not
+// show them only once they have been held for twice the largest RTO of any
+// link, within these bounds: by then the origin's own copy has normally
+// arrived. Own messages go out right away.
+constexpr static std::chrono::milliseconds MIN_RELAY_DELAY{100};
+constexpr static std::chrono::milliseconds MAX_RELAY_DELAY{2000};
+// An ack vector that changed goes out on its own at most this often per
+// peer, and rides along with DATA whenever there is some. Vectors are not
+// acknowledged: an unchanged one is repeated, backing off up to
+// MAX_ACK_VECTOR_INTERVAL.
+constexpr static std::chrono::milliseconds ACK_VECTOR_INTERVAL{2};
+constexpr static std::chrono::milliseconds MAX_ACK_VECTOR_INTERVAL{1000};
+
+// FIFO uniform reliable broadcast over all-to-all PerfectLinks. A process
+// holds the messages of an origin up to the first one it is missing, and
+// tells every peer how far that is for each origin in an ack vector. A
+// message is delivered once a majority, this process included, holds it and
+// every earlier message of its origin has been delivered.
+//
+// The origin sends its messages to every peer. Others relay a message to a
+// peer only if the peer's vector still does not show it a while after they
+// got it, which is what makes the broadcast uniform when the origin
+// crashes, and otherwise costs nothing. Relays are not queued per peer:
+// each link pulls the next run of an origin from a cursor when it has room
+// in its window, so packets are runs of consecutive ids, and the link
+// coalesces them into shared datagrams. A relay of message s tells, like a
+// vector, that its sender holds the origin's messages up to s.
+class FifoBroadcast {
+private:
+    // One entry of an origin's pending ring, for message id id % PENDING_WINDOW.
+    struct Pending {
+        // Processes known to hold the message, counted once each.
+        uint16_t holders{0};
+        bool have{false};
+    };
+
+    struct Origin {
+        // Next message to deliver, the oldest one in the ring.
+        uint32_t next_delivery{1};
+        // Every message below it is held or delivered.
+        uint32_t contiguous{1};
+        // contiguous as of the last two relay ticks: messages below stable
+        // have been held for a relay delay at least.
+        uint32_t snapshot{1};
+        uint32_t stable{1};
+        std::vector<Pending> pending;
+    };
+
+    struct PeerVector {
+        // _progress when the last vector went out.
+        uint64_t sent_at_progress{0};
+        // When the next one may go out on its own.
+        std::chrono::steady_clock::time_point due{};
+        std::chrono::milliseconds interval{ACK_VECTOR_INTERVAL};
+    };
+
+    const uint64_t _pid;
+    const uint32_t _n_messages;
+    const size_t _n_processes;
+    const size_t _majority;
+    // Process ids index the tables below, up to _stride - 1.
+    const size_t _stride;
+    PerfectLink &_pl;
+    LogWriter &_log;
+    std::mutex _mutex;
+    // Indexed by origin id, empty for ids without a process.
+    std::vector<Origin> _origins;
+    // [origin * _stride + peer]: every message of origin below it is held by
+    // peer, as far as its vectors and relays tell, and how far peer has been
+    // counted as a holder. Only messages within the pending window are.
+    std::vector<uint32_t> _held;
+    std::vector<uint32_t> _counted;
+    // [peer * _stride + origin]: next message of origin to relay to peer.
+    std::vector<uint32_t> _relayed;
+    // Per peer, the origin its next relay starts looking at.
+    std::vector<size_t> _next_origin;
+    // Per peer, the value of _relay_epoch when its last relay found nothing,
+    // so idle links are not scanned again before there is anything new.
+    std::vector<uint64_t> _idle_at;
+    std::vector<PeerVector> _vectors;
+    // Bumped whenever some origin's contiguous prefix grows, which changes
+    // the ack vector.
+    uint64_t _progress{1};
+    // Bumped whenever there may be new messages to relay.
+    uint64_t _relay_epoch{1};
+    // Relay ticks are due every relay delay while some messages are not
+    // stable yet.
+    std::chrono::steady_clock::time_point _next_tick{};
+    bool _unstable{false};
+    uint32_t _next_broadcast{1};
+    // Last thread that logged lines, see order_lines().
+    std::thread::id _last_logger{};
+    std::atomic<uint64_t> _n_delivered{0};
+    std::atomic<uint64_t> _refused{0};
+    std::atomic<uint64_t> _relays{0};
+    std::atomic<uint64_t> _vectors_sent{0};
+    std::atomic<uint64_t> _vectors_alone{0};
+    bool _stop{false};
+
+    Pending& pending(Origin& origin, uint32_t id);
+    void hold(uint64_t origin_id, Origin& origin, uint64_t peer, uint32_t end);
+    void count_holders(uint64_t origin_id, Origin& origin, uint64_t peer);
+    void advance(Origin& origin);
+    void deliver(uint64_t origin_id, Origin& origin);
+    void order_lines();
+    void broadcast();
+    bool tick(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration delay);
+    std::chrono::steady_clock::time_point next_vector_due() const;
+    void print_stats();
+
+public:
+    FifoBroadcast(uint64_t pid, const std::vector<Parser::Host>& hosts, uint32_t n_messages,
+                  PerfectLink &pl, LogWriter &log);
+
+    // PerfectLink callbacks, see PeerAcceptCallback, PeerPacketSource,
+    // PeerAckVectorSource and PeerAckVectorCallback.
+    bool on_relay(uint64_t peer, const PacketView& pkt);
+    size_t next_relay(uint64_t peer, WireFormat format, uint8_t *data, uint8_t& flags);
+    size_t ack_vector(uint64_t peer, uint8_t *data, size_t capacity, bool standalone);
+    void on_ack_vector(uint64_t peer, const PacketView& pkt);
+
+    // Broadcasts and sends from the calling thread until stop().
+    void run();
+    // No message is broadcast once it returns.
+    void stop();
+    uint64_t delivered() const;
+};
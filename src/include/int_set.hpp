@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "packet.hpp"
+
+// How a chunk of an IntSet is encoded, its first byte. DELTA: varint count,
+// then the varint first value and the gaps to the next ones, less one.
+// BITMAP: varint index of the first 64-value word, varint word count, then
+// the 8-byte host-endian words.
+constexpr static uint8_t SET_CHUNK_DELTA = 0;
+constexpr static uint8_t SET_CHUNK_BITMAP = 1;
+// Smallest chunk that holds at least one value whatever the encoding.
+constexpr static size_t MIN_SET_CHUNK_SIZE = 1 + 2 * MAX_VARINT32_SIZE + sizeof(uint64_t);
+
+// Set of uint32_t values, the proposals of lattice agreement. A sparse set is
+// a sorted vector. Once a bitmap over the range its values span takes no
+// more room, it switches to one, so that unions, differences and inclusion
+// tests are word operations, vectorized where the CPU allows. A union with
+// far away values makes it a vector again.
+class IntSet {
+private:
+    // Sorted values, if not dense.
+    std::vector<uint32_t> _values;
+    // If dense, bit i of _words[w] stands for value _base + 64 * w + i. _base
+    // is a multiple of 64, and the first and last words are not zero.
+    std::vector<uint64_t> _words;
+    uint32_t _base{0};
+    bool _dense{false};
+    size_t _size{0};
+
+    uint64_t word_begin() const;
+    uint64_t word_end() const;
+    bool bitmap_pays(uint64_t n_words, size_t size) const;
+    void to_bitmap(uint64_t first_word, uint64_t end_word);
+    void trim();
+    bool merge_bitmap(const IntSet& other, std::vector<uint32_t> *added);
+
+public:
+    IntSet() = default;
+    // The values must be sorted, without duplicates.
+    explicit IntSet(std::vector<uint32_t> values);
+
+    size_t size() const;
+    bool empty() const;
+    bool dense() const;
+    bool contains(uint32_t value) const;
+    // Whether every value of other is in the set.
+    bool includes(const IntSet& other) const;
+    // Adds the values of other. Returns whether the set grew. The values
+    // that were not in the set are appended to added, in order, if given.
+    bool merge(const IntSet& other, std::vector<uint32_t> *added = nullptr);
+    // The values that are not in other.
+    IntSet difference(const IntSet& other) const;
+    // Sorted.
+    std::vector<uint32_t> values() const;
+    // Calls f(value) for every value, in order.
+    template <typename F>
+    void for_each(F&& f) const;
+
+    // Appends the set to out in chunks of at most chunk_size bytes, which
+    // must be MIN_SET_CHUNK_SIZE at least, each one decodable on its own.
+    // Chunk i ends at ends[i]; an empty set is one chunk. Dense sets are sent
+    // as bitmaps if that is smaller than the gaps.
+    void encode_chunks(size_t chunk_size, std::vector<uint8_t>& out, std::vector<size_t>& ends) const;
+    // Adds the values of the chunk at data. Returns the bytes it takes, 0 if
+    // it is malformed.
+    size_t decode_chunk(const uint8_t *data, size_t size);
+};
+
+template <typename F>
+void IntSet::for_each(F&& f) const {
+  if (!_dense) {
+    for (uint32_t value : _values) {
+      f(value);
+    }
+    return;
+  }
+  for (size_t w = 0; w < _words.size(); w++) {
+    uint64_t bits = _words[w];
+    while (bits != 0) {
+      auto bit = static_cast<uint32_t>(__builtin_ctzll(bits));
+      bits &= bits - 1;
+      f(_base + static_cast<uint32_t>(w * 64) + bit);
+    }
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <linux/io_uring.h>
+
+// Buffer group the kernel picks receive buffers from.
+constexpr static uint16_t IO_URING_BUFFER_GROUP = 0;
+
+// Minimal io_uring driven through the raw syscalls: one submission and one
+// completion ring, plus a ring of provided buffers that multishot receives
+// fill. Not thread safe, a ring belongs to the thread that submits to it.
+class IoUring {
+private:
+    int _ring_fd{-1};
+    // Submission and completion rings share a single mapping.
+    void *_rings{nullptr};
+    size_t _rings_size{0};
+    struct io_uring_sqe *_sqes{nullptr};
+    size_t _sqes_size{0};
+    uint32_t *_sq_head{nullptr};
+    uint32_t *_sq_tail{nullptr};
+    uint32_t *_sq_array{nullptr};
+    uint32_t _sq_mask{0};
+    uint32_t _sq_entries{0};
+    uint32_t _sq_local_tail{0};
+    uint32_t _to_submit{0};
+    uint32_t *_cq_head{nullptr};
+    uint32_t *_cq_tail{nullptr};
+    uint32_t _cq_mask{0};
+    struct io_uring_cqe *_cqes{nullptr};
+
+    struct io_uring_buf_ring *_buf_ring{nullptr};
+    size_t _buf_ring_size{0};
+    uint16_t _buf_count{0};
+    uint16_t _buf_tail{0};
+    size_t _buf_size{0};
+    std::vector<uint8_t> _buffers;
+
+    IoUring() = default;
+    bool setup(uint32_t entries, uint32_t cq_entries);
+    bool register_buffers(uint16_t count, size_t size);
+
+public:
+    // Returns nullptr when the kernel lacks io_uring or any of the features
+    // used here (provided buffer rings, multishot recvmsg).
+    static std::unique_ptr<IoUring> create(uint32_t entries, uint32_t cq_entries,
+                                           uint16_t buf_count, size_t buf_size);
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    struct io_uring_sqe *get_sqe();
+    int submit_and_wait(uint32_t min_complete);
+
+    // Calls f(cqe) for every available completion, then releases them.
+    template <typename F>
+    size_t for_each_cqe(F f) {
+      uint32_t head = *_cq_head;
+      uint32_t tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+      size_t n = tail - head;
+      for (; head != tail; head++) {
+        f(_cqes[head & _cq_mask]);
+      }
+      __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+      return n;
+    }
+
+    uint8_t *buffer(uint16_t bid);
+    size_t buffer_size() const;
+    void recycle_buffer(uint16_t bid);
+    void publish_buffers();
+};
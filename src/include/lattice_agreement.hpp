@@ -0,0 +1,194 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "config.hpp"
+#include "int_set.hpp"
+#include "parser.hpp"
+#include "perfect_link.hpp"
+#include "log_writer.hpp"
+
+// Shots proposed at once. A shot is opened once the one MAX_ACTIVE_SHOTS
+// before it has been decided and logged.
+constexpr static uint32_t MAX_ACTIVE_SHOTS = 64;
+// Packets lattice agreement sends carry at most MESSAGES_PER_PACKET messages,
+// the link coalesces them into full datagrams. A quarter of a datagram keeps
+// set chunks large while leaving the link about a hundred packets in flight.
+constexpr static size_t LATTICE_PACKET_SIZE = MAX_LINK_DATA_SIZE / 4;
+
+// Multi-shot lattice agreement over all-to-all PerfectLinks. Every shot is an
+// independent single-shot instance: the proposer sends its set with a
+// proposal number to every acceptor, which acknowledges it if it contains
+// everything the acceptor accepted so far and otherwise refuses it with the
+// union of both. The proposer decides once a majority, itself included,
+// acknowledged the same proposal number, and proposes again with the values
+// the refusals brought in as soon as a majority answered otherwise.
+//
+// Sets go out as deltas. An acceptor logs the values it accepts in the order
+// they come in, and answers with the length of that log, its version. A
+// refusal carries the accepted values the proposal lacks, not the whole set.
+// A new round sends an acceptor that answered the previous one only the
+// values added since, on top of the version it answered with; the others get
+// the whole proposal.
+//
+// Up to MAX_ACTIVE_SHOTS shots are in flight, their messages tagged with the
+// shot id, so that throughput is not bound to one round trip per shot.
+// Shots decide out of order and their decisions wait in a reorder buffer to
+// be logged in shot order.
+//
+// Messages are queued per peer and packed into packets when the link pulls
+// them. A set that does not fit in a packet is sent in parts, which the
+// receiver puts back together.
+class LatticeAgreement {
+private:
+    enum class MessageType : uint8_t {
+        PROPOSAL,
+        ACK,
+        NACK
+    };
+
+    // Proposer side of an active shot, slot id % MAX_ACTIVE_SHOTS.
+    struct Shot {
+        uint32_t id{0};
+        bool active{false};
+        // Decided, waiting in the reorder buffer.
+        bool decided{false};
+        uint32_t number{0};
+        IntSet proposal;
+        // Values the refusals of the current round brought in.
+        IntSet refused;
+        // Acceptors that answered the current round, the version they
+        // answered with and the values they refused it with.
+        std::vector<bool> answered;
+        std::vector<uint32_t> versions;
+        std::vector<IntSet> refusals;
+        size_t acks{0};
+        size_t nacks{0};
+    };
+
+    // Acceptor side of a shot. Kept for every shot, decided or not: a
+    // proposer may be late in any of them, and answering it safely takes
+    // everything accepted so far.
+    struct Acceptor {
+        IntSet accepted;
+        // The accepted values in the order they were accepted. A version is
+        // a length of it.
+        std::vector<uint32_t> log;
+        // Per peer, the number of its last proposal put back together from
+        // parts. Empty until one came in parts.
+        std::vector<uint32_t> assembled;
+    };
+
+    // A set encoded once in chunks that fit in a packet, one per part of
+    // the message, and shared between the queues it is sent to.
+    struct EncodedSet {
+        std::vector<uint8_t> bytes;
+        // Chunk i ends at ends[i].
+        std::vector<size_t> ends;
+    };
+
+    // A message waiting in a peer's queue.
+    struct Outgoing {
+        MessageType type;
+        uint32_t shot;
+        uint32_t number;
+        // PROPOSAL: the acceptor version the values add to. ACK and NACK:
+        // the version once answered.
+        uint32_t version;
+        // Next part to send, sets larger than a packet go in several.
+        uint32_t part;
+        std::shared_ptr<const EncodedSet> set;
+    };
+
+    // Parts of a set received so far.
+    struct Partial {
+        uint32_t number{0};
+        // Every part of one message carries the same version.
+        uint32_t version{0};
+        std::vector<bool> received;
+        size_t missing{0};
+        IntSet values;
+    };
+
+    struct Message {
+        MessageType type;
+        uint32_t shot;
+        uint32_t number;
+        uint32_t version;
+        uint32_t part;
+        uint32_t n_parts;
+        IntSet values;
+    };
+
+    const uint64_t _pid;
+    const Config &_cfg;
+    const uint32_t _n_shots;
+    const size_t _majority;
+    // Process ids index the tables below, up to _stride - 1.
+    const size_t _stride;
+    PerfectLink &_pl;
+    LogWriter &_log;
+    std::vector<uint64_t> _peers;
+    std::mutex _mutex;
+    std::vector<Shot> _shots;
+    std::vector<Acceptor> _acceptors;
+    // Per peer, the messages to send to it, oldest first.
+    std::vector<std::deque<Outgoing>> _queues;
+    // Messages were queued since the sender was last woken.
+    bool _queued{false};
+    // Sets being received in parts, by peer, shot and whether they come with
+    // a NACK. Only incomplete ones have an entry.
+    std::unordered_map<uint64_t, Partial> _partials;
+    // Next shot to open, and next one to log.
+    uint32_t _next_shot{0};
+    uint32_t _next_decision{0};
+    // Last thread that logged lines, see order_lines().
+    std::thread::id _last_logger{};
+    std::atomic<uint64_t> _n_decided{0};
+    std::atomic<uint64_t> _rounds{0};
+    std::atomic<uint64_t> _messages{0};
+    std::atomic<uint64_t> _bytes{0};
+    std::atomic<uint64_t> _packets{0};
+    bool _stop{false};
+
+    Shot& shot(uint32_t id);
+    void open_shots();
+    void propose(Shot& shot, const IntSet& added);
+    void accept(uint64_t peer, uint32_t shot_id, uint32_t number, uint32_t version, const IntSet& values);
+    void on_answer(uint64_t peer, uint32_t shot_id, uint32_t number, bool ack, uint32_t version,
+                   const IntSet& values);
+    void decide(Shot& shot);
+    void on_message(uint64_t peer, Message& message);
+    static uint64_t partial_key(uint64_t peer, MessageType type, uint32_t shot_id);
+    bool reassemble(uint64_t peer, Message& message);
+    void drop_partials(uint32_t shot_id);
+    static std::shared_ptr<const EncodedSet> encode_set(const IntSet& values);
+    static size_t encode_message(const Outgoing& message, uint8_t *data, size_t capacity);
+    static size_t decode_message(const uint8_t *data, size_t size, Message& message);
+    void send(uint64_t peer, Outgoing message);
+    bool stale(const Outgoing& message);
+    void order_lines();
+    void print_stats();
+
+public:
+    // Proposals are read from cfg as shots open, it must outlive the object.
+    LatticeAgreement(uint64_t pid, const std::vector<Parser::Host>& hosts, const Config &cfg,
+                     PerfectLink &pl, LogWriter &log);
+
+    // PerfectLink callbacks, see PeerAcceptCallback and PeerPacketSource.
+    bool on_packet(uint64_t peer, const PacketView& pkt);
+    size_t next_packet(uint64_t peer, WireFormat format, uint8_t *data, uint8_t& flags);
+
+    // Proposes and sends from the calling thread until stop().
+    void run();
+    // No shot is opened once it returns.
+    void stop();
+    uint64_t decided() const;
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+#include "buffer_pool.hpp"
+
+// Size of the blocks threads fill before handing them to the writer.
+constexpr static size_t LOG_BLOCK_SIZE = 64 * 1024;
+// Threads that may append to one LogWriter.
+constexpr static size_t MAX_LOG_THREADS = 64;
+// Output files larger than this are out of spec, the writer warns once.
+constexpr static uint64_t MAX_OUTPUT_SIZE = 64 * 1024 * 1024;
+// Longest line: event char, two 20-digit integers, two spaces, newline.
+constexpr static size_t MAX_LOG_LINE_SIZE = 1 + 2 * (1 + 20) + 1;
+// Lines of a run are formatted into a buffer of this size and appended
+// together.
+constexpr static size_t LOG_RUN_CHUNK_SIZE = 1024;
+
+// Formats value in decimal at out and returns the end of the digits.
+char *format_uint(char *out, uint64_t value);
+
+enum class OutputMode {
+    // Per-thread blocks written by a writer thread.
+    BUFFERED,
+    // File preallocated to MAX_OUTPUT_SIZE and mapped, lines are copied
+    // straight into the mapping. No writer thread.
+    MAPPED
+};
+
+// Output log shared by all threads of a process. Each thread formats lines
+// into a block of its own; full blocks are pushed on a lock-free stack and
+// written with pwritev() by a dedicated writer thread, so appending a line
+// takes no lock and no syscall. In MAPPED mode a line reserves its bytes in
+// the mapped file with a fetch-add instead.
+class LogWriter {
+private:
+    struct Block {
+        Block *next{nullptr};
+        size_t used{0};
+        char data[LOG_BLOCK_SIZE];
+    };
+
+    // The owning thread holds `busy` while appending, flush() holds it while
+    // taking the block away.
+    struct ThreadBuffer {
+        std::atomic<bool> busy{false};
+        std::thread::id owner;
+        Block *block{nullptr};
+    };
+
+    // Blocks are recycled, not freed: they are taken by the appending threads
+    // and given back by the writer.
+    BufferPool _blocks{sizeof(Block)};
+    const uint64_t _id;
+    int _fd;
+    OutputMode _mode;
+    // Stops appends, set by seal().
+    std::atomic<bool> _sealed{false};
+    // MAPPED mode: bytes reserved so far, offset of the first line that did
+    // not fit, and appends between their check of _sealed and their copy.
+    char *_map{nullptr};
+    std::atomic<uint64_t> _reserved{0};
+    std::atomic<uint64_t> _map_end{MAX_OUTPUT_SIZE};
+    std::atomic<uint32_t> _mapped_appends{0};
+    // Guarded by the write lock.
+    uint64_t _offset{0};
+    std::atomic<bool> _oversize_reported{false};
+    std::array<std::atomic<ThreadBuffer *>, MAX_LOG_THREADS> _buffers{};
+    std::atomic<size_t> _n_buffers{0};
+    // Full blocks, most recent first.
+    std::atomic<Block *> _full{nullptr};
+    // Serializes taking and writing blocks, so the lines of one thread keep
+    // their order in the file.
+    std::mutex _write_mutex;
+    std::mutex _writer_mutex;
+    std::condition_variable _writer_cv;
+    std::atomic<bool> _stop_writer{false};
+
+    ThreadBuffer *thread_buffer();
+    ThreadBuffer *register_thread();
+    void acquire(ThreadBuffer *buffer);
+    void release(ThreadBuffer *buffer);
+    static void push(std::atomic<Block *> &stack, Block *block);
+    void hand_off(Block *block);
+    void write_blocks(Block *blocks);
+    void write_iov(struct iovec *iov, int count, size_t size);
+    Block *take_full();
+    Block *new_block();
+    void free_block(Block *block);
+    bool map_file();
+    void append(const char *line, size_t len);
+    void append_mapped(const char *line, size_t len);
+    void append_run(const char *prefix, size_t prefix_len, uint64_t first, uint64_t count);
+    uint64_t mapped_size() const;
+
+public:
+    // Falls back to BUFFERED if the file cannot be preallocated or mapped.
+    explicit LogWriter(const std::string& path, OutputMode mode = OutputMode::BUFFERED);
+    ~LogWriter();
+    LogWriter(const LogWriter&) = delete;
+    LogWriter& operator=(const LogWriter&) = delete;
+
+    // "<event> <value>\n"
+    void append_line(char event, uint64_t value);
+    // "<event> <first> <second>\n"
+    void append_line(char event, uint64_t first, uint64_t second);
+    // "<event> <first + i>\n" for i < count.
+    void append_lines(char event, uint64_t first, uint64_t count);
+    // "<event> <value> <first + i>\n" for i < count.
+    void append_lines(char event, uint64_t value, uint64_t first, uint64_t count);
+    // "<values[0]> <values[1]> ... <values[n - 1]>\n"
+    void append_values(const uint32_t *values, size_t n);
+
+    // Passes the lines the given thread appended so far on to the writer,
+    // ahead of any block handed off later. Lets callers that order lines of
+    // several threads under a lock of their own keep that order in the file.
+    // Nothing to do in MAPPED mode.
+    void sync(std::thread::id thread);
+
+    OutputMode mode() const;
+    BufferPoolStats block_stats() const;
+
+    void run();
+    void stop();
+    void flush();
+    void seal();
+    void close();
+};
@@ -1,52 +1,98 @@
 #pragma once
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
-#include <functional>
-#include <vector>
 
 enum class PacketType {
     DATA,
     ACK,
     SYN,
+    // Cumulative ACK in seq_id plus a bitmap of out-of-order receipts.
+    SACK,
+    // Watermarks of the layer above, unsequenced and never acknowledged.
+    ACK_VECTOR,
 };
 
+// LEGACY: host-endian 8-byte pid, 4-byte type, 4-byte seq_id, 4-byte length.
+// COMPACT: 1 marker/version byte, 1 type+flags byte, 16-bit little-endian
+// sender id, then the seq_id and the payload length as LEB128 varints.
+// COALESCED: COMPACT frames, several of them back to back in one datagram.
+// PAYLOAD_FLAGS: COALESCED, and DATA payloads may use the encodings the
+// header flags announce (payload_codec.hpp). Earlier versions ignore flags.
+// ACK_VECTORS: PAYLOAD_FLAGS, and ACK_VECTOR frames may be sent, alone or
+// riding along in a datagram of DATA frames.
+// A legacy datagram starts with the low byte of the pid, which is at most 128,
+// so the high bits of COMPACT_MARKER tell the two formats apart.
+enum class WireFormat : uint8_t {
+    LEGACY = 1,
+    COMPACT = 2,
+    COALESCED = 3,
+    PAYLOAD_FLAGS = 4,
+    ACK_VECTORS = 5,
+};
+
+constexpr static WireFormat LATEST_WIRE_FORMAT = WireFormat::ACK_VECTORS;
+// Largest coalesced datagram: an Ethernet MTU less the IPv4 and UDP headers,
+// so that nothing is fragmented on the way.
+constexpr static size_t MAX_DATAGRAM_SIZE = 1500 - 20 - 8;
+constexpr static uint8_t COMPACT_MARKER = 0xC0;
+constexpr static uint8_t COMPACT_VERSION_MASK = 0x0F;
+constexpr static uint8_t COMPACT_TYPE_MASK = 0x0F;
+// High nibble of the type byte, see payload_codec.hpp. Legacy headers have
+// no room for flags.
+constexpr static uint8_t COMPACT_FLAGS_MASK = 0xF0;
+
 constexpr static size_t HEADER_SIZE = sizeof(uint64_t) + sizeof(PacketType) + sizeof(uint32_t) + sizeof(uint32_t);
+constexpr static size_t MAX_VARINT32_SIZE = 5;
+constexpr static size_t COMPACT_MAX_HEADER_SIZE = 1 + 1 + sizeof(uint16_t) + 2 * MAX_VARINT32_SIZE;
+static_assert(COMPACT_MAX_HEADER_SIZE <= HEADER_SIZE, "HEADER_SIZE bounds every header format");
+
+struct PacketHeader {
+    uint64_t pid;
+    PacketType type;
+    uint32_t seq_id;
+    uint32_t data_size;
+    uint8_t flags = 0;
+};
+
+size_t varint_size(uint32_t value);
+size_t put_varint(uint8_t *buffer, uint32_t value);
+// Returns the number of bytes consumed, or 0 if the varint is truncated or
+// does not fit in 32 bits.
+size_t get_varint(const uint8_t *buffer, size_t size, uint32_t& value);
 
-class Packet {
+// Non-owning view of a serialized packet. The payload points into the buffer
+// the view was decoded from and is only valid for as long as that buffer is.
+class PacketView {
 private:
-    uint64_t _pid;
-    PacketType _type;
-    uint32_t _seq_id;
-    std::vector<uint8_t> _data;
+    PacketHeader _header{};
+    const uint8_t *_data = nullptr;
+    WireFormat _format = WireFormat::LEGACY;
+    // Bytes the decoded packet took in the buffer.
+    size_t _size = 0;
+
+    bool decode_legacy(const uint8_t *buffer, size_t size);
+    bool decode_compact(const uint8_t *buffer, size_t size);
+    static size_t encode_legacy(uint8_t *buffer, size_t capacity,
+                                const PacketHeader& header, const uint8_t *data);
+    static size_t encode_compact(uint8_t *buffer, size_t capacity, const PacketHeader& header,
+                                 const uint8_t *data, WireFormat format);
 
 public:
-    Packet() = default;
-    Packet(uint64_t pid, PacketType type, uint32_t seq_id);
-    Packet(uint64_t pid, PacketType type, uint32_t seq_id, const std::vector<uint8_t>& data);
+    PacketView() = default;
+    PacketView(const PacketHeader& header, const uint8_t *data);
+
+    bool decode(const uint8_t *buffer, size_t size);
+    WireFormat wire_format() const;
     uint64_t pid() const;
     PacketType packet_type() const;
     uint32_t seq_id() const;
-    const std::vector<uint8_t>& data() const;
-    std::vector<uint8_t> serialize() const;
-    void deserialize(const std::vector<uint8_t>& buffer);
-};
+    uint8_t flags() const;
+    const uint8_t *data() const;
+    size_t data_size() const;
+    size_t size() const;
 
-struct PacketHash {
-    std::size_t operator()(const Packet& pkt) const {
-      std::hash<uint32_t> hash_seq_id;
-      return hash_seq_id(pkt.seq_id());
-    }
+    static size_t encode(uint8_t *buffer, size_t capacity, const PacketHeader& header,
+                         const uint8_t *data, WireFormat format);
 };
-
-struct PacketEqual {
-    bool operator()(const Packet& lhs, const Packet& rhs) const {
-      return lhs.seq_id() == rhs.seq_id();
-    }
-};
-
-struct PacketLess {
-    bool operator()(const Packet& lhs, const Packet& rhs) const {
-      return std::less<uint32_t>()(lhs.seq_id(), rhs.seq_id());
-    }
-};
\ No newline at end of file
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "packet.hpp"
+
+// How a DATA payload encodes its message ids, kept in the header flags.
+// RAW: 4-byte host-endian ids. RUN: varint first id and varint count of
+// consecutive ids. DELTA: varint first id, then for every later id the varint
+// gap to the previous one, less one. Formats before PAYLOAD_FLAGS only
+// carry RAW.
+constexpr static uint8_t PAYLOAD_RAW = 0x00;
+constexpr static uint8_t PAYLOAD_RUN = 0x10;
+constexpr static uint8_t PAYLOAD_DELTA = 0x20;
+constexpr static uint8_t PAYLOAD_ENCODING_MASK = 0x30;
+// Up to 8 messages of sizeof(uint32_t) are packed in a DATA packet.
+constexpr static uint32_t MESSAGES_PER_PACKET = 8;
+
+// Writes the n ids, in increasing order and MESSAGES_PER_PACKET at most, in
+// the smallest encoding the format can flag, falling back to RAW. The output
+// holds n * sizeof(uint32_t) bytes at most. Returns the payload size and sets
+// flags to the encoding used.
+size_t encode_messages(const uint32_t *ids, size_t n, WireFormat format,
+                       uint8_t *out, uint8_t& flags);
+
+// Calls on_run(first, count) for every run of consecutive ids in the
+// payload, in order. Returns false if the payload is malformed; runs decoded
+// before the error have been passed on.
+template <typename F>
+bool decode_messages(const uint8_t *data, size_t size, uint8_t flags, F&& on_run) {
+  switch (flags & PAYLOAD_ENCODING_MASK) {
+    case PAYLOAD_RAW:
+    {
+      if (size % sizeof(uint32_t) != 0) {
+        return false;
+      }
+      uint32_t first = 0;
+      uint32_t count = 0;
+      for (size_t i = 0; i < size; i += sizeof(uint32_t)) {
+        uint32_t id;
+        std::memcpy(&id, data + i, sizeof(id));
+        if (count > 0 && id == first + count) {
+          count++;
+          continue;
+        }
+        if (count > 0) {
+          on_run(first, count);
+        }
+        first = id;
+        count = 1;
+      }
+      if (count > 0) {
+        on_run(first, count);
+      }
+      return true;
+    }
+    case PAYLOAD_RUN:
+    {
+      uint32_t first;
+      uint32_t count;
+      size_t n = get_varint(data, size, first);
+      if (n == 0 || n == size || get_varint(data + n, size - n, count) != size - n) {
+        return false;
+      }
+      // A run is never empty nor longer than a packet holds.
+      if (count == 0 || count > MESSAGES_PER_PACKET) {
+        return false;
+      }
+      on_run(first, count);
+      return true;
+    }
+    case PAYLOAD_DELTA:
+    {
+      uint32_t first;
+      size_t offset = get_varint(data, size, first);
+      if (offset == 0) {
+        return false;
+      }
+      uint32_t count = 1;
+      while (offset < size) {
+        uint32_t gap;
+        size_t n = get_varint(data + offset, size - offset, gap);
+        if (n == 0) {
+          return false;
+        }
+        offset += n;
+        if (gap == 0) {
+          count++;
+          continue;
+        }
+        on_run(first, count);
+        first = first + count + gap;
+        count = 1;
+      }
+      on_run(first, count);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
@@ -1,44 +1,86 @@
 #pragma once
 
-#include <unordered_set>
 #include <unordered_map>
+#include <vector>
 #include "packet.hpp"
 #include "stubborn_link.hpp"
+#include "delivered_window.hpp"
 #include "parser.hpp"
 #include "event_loop.hpp"
 
+// All-to-all mode: hands a DATA packet from peer to the layer above, which
+// returns false to refuse it for now.
+using PeerAcceptCallback = std::function<bool(uint64_t peer, const PacketView& pkt)>;
+// All-to-all mode: the PacketSource of the link to peer.
+using PeerPacketSource = std::function<size_t(uint64_t peer, WireFormat format, uint8_t *data, uint8_t& flags)>;
+// All-to-all mode: the AckVectorSource and AckVectorCallback of the link to
+// peer.
+using PeerAckVectorSource = std::function<size_t(uint64_t peer, uint8_t *data, size_t capacity, bool standalone)>;
+using PeerAckVectorCallback = std::function<void(uint64_t peer, const PacketView& pkt)>;
+
 class PerfectLink {
 private:
-  using delivered_t = std::pair<uint64_t, uint32_t>;
-  struct PairHash {
-      std::size_t operator()(const delivered_t & p) const {
-        std::size_t h1 = std::hash<uint64_t>{}(p.first);
-        std::size_t h2 = std::hash<uint32_t>{}(p.second);
-
-        // Combine the two hashes using XOR and bit shifting
-        return h1 ^ (h2 << 1);
-      }
-  };
-
   in_addr_t _addr;
   uint16_t _port;
   bool _sender;
-  std::mutex _delivered_mutex;
-  std::unordered_set<delivered_t, PairHash> _delivered;
+  // Wakes the sending thread, shared by all links.
+  SendSignal _send_signal;
+  // Receiver only: what has been delivered from each sender, indexed by
+  // sender id. Updated from the event loop workers without a lock.
+  std::vector<DeliveredWindow> _delivered;
   DeliverCallback _deliver_cb;
   std::unordered_map<uint64_t, StubbornLink*> _sl_map;
   std::atomic<bool> _stop{false};
+  // The only socket of the process, shared by every link.
+  UDPSocket _socket;
+  // Links indexed by peer id for the receive path, nullptr for ids without a
+  // link. Peers whose packets do not carry their own id (legacy ACKs from
+  // older binaries echo ours) are found by address instead.
+  std::vector<StubbornLink*> _links;
+  std::unordered_map<uint64_t, StubbornLink*> _links_by_addr;
+  // Links that received DATA in the current receive batch and owe a SACK.
+  // Only touched from the read event handler.
+  std::vector<StubbornLink*> _sack_dirty;
+  // All-to-all: the links in the order send_round() serves them, and where
+  // the next round starts.
+  std::vector<StubbornLink*> _senders;
+  size_t _next_sender{0};
+  ReadEventHandler _read_event_handler;
+  EventData _read_event_data{};
 
-  void deliver_packet(const Packet& pkt);
+  bool deliver_packet(uint64_t peer, const PacketView& pkt);
+  void process_packet(const PacketView& pkt, const struct sockaddr_in& source);
+  StubbornLink *find_link(const PacketView& pkt, const struct sockaddr_in& source) const;
+  void flush_sacks();
+  static uint64_t addr_key(in_addr_t addr, uint16_t port);
+  uint32_t advertised_window(size_t n_peers) const;
+  void add_link(StubbornLink *sl, const Parser::Host& host);
+  void listen(EventLoop& event_loop);
 public:
   PerfectLink(uint64_t pid, in_addr_t addr, uint16_t port, bool sender,
               const std::vector<Parser::Host>& hosts, uint64_t receiver_proc,
               EventLoop& event_loop, DeliverCallback deliver_cb);
+  // All-to-all: a link to every other host, each filled from source with
+  // packets of up to max_data_size bytes. Packets are passed on as they come,
+  // duplicates included: a layer that sources its own packets tracks what it
+  // has seen anyway. Ack vectors are optional.
+  PerfectLink(uint64_t pid, in_addr_t addr, uint16_t port,
+              const std::vector<Parser::Host>& hosts, EventLoop& event_loop,
+              PeerAcceptCallback accept_cb, PeerPacketSource source,
+              PeerAckVectorSource ack_vector_source = nullptr,
+              PeerAckVectorCallback ack_vector_cb = nullptr,
+              size_t max_data_size = MAX_DATA_SIZE);
   ~PerfectLink();
 
-  void send(uint32_t n_messages, uint64_t peer, std::ofstream &outfile,
-            std::mutex &outfile_mutex);
+  void send(uint32_t n_messages, uint64_t peer, LogWriter &log);
   void send_syn_packets();
+  // All-to-all: one pass of the send loop over every link, on the calling
+  // thread. Returns false if the socket buffer filled up. Lowers
+  // next_deadline to when a link next needs attention.
+  bool send_round(LogWriter &log, std::chrono::steady_clock::time_point &next_deadline);
+  SendSignal& send_signal();
+  SendStats send_stats();
   void stop();
+  RecvStats recv_stats() const;
 };
 
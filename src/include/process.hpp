@@ -1,15 +1,30 @@
 #pragma once
 
+#include <chrono>
+#include <csignal>
 #include <memory>
 #include <unordered_map>
 #include "parser.hpp"
 #include "perfect_link.hpp"
+#include "fifo_broadcast.hpp"
+#include "lattice_agreement.hpp"
 #include "packet.hpp"
 #include "config.hpp"
 #include "event_loop.hpp"
 #include "thread_pool.hpp"
+#include "log_writer.hpp"
 
-constexpr uint32_t event_loop_workers = 10;
+// Event loops and the log writer run on pinned threads, next to the main
+// thread, which runs the send loop of the protocol. Nothing enqueues short
+// tasks, so the pool starts no workers for them.
+constexpr uint32_t event_loop_workers = 5;
+constexpr uint32_t log_writer_threads = 1;
+constexpr uint32_t task_workers = 0;
+static_assert(1 + event_loop_workers + log_writer_threads + task_workers <= THREAD_BUDGET,
+              "more threads than the budget allows");
+// Once the output is sealed, a process still not gone after this many
+// seconds is killed by SIGALRM.
+constexpr unsigned int stop_deadline_s = 2;
 
 class Process {
 public:
@@ -18,6 +33,10 @@ public:
           const std::string& outfname);
   ~Process();
 
+  // SIGTERM and SIGINT, which call stop() from an event loop worker. main()
+  // blocks them before any thread starts.
+  static sigset_t shutdown_signals();
+
   uint64_t pid() const;
   void run(const Config& cfg);
   void stop();
@@ -30,16 +49,26 @@ private:
     ThreadPool *_thread_pool;
     std::vector<Parser::Host> _hosts;
     PerfectLink *_pl;
-    std::mutex _outfile_mutex;
-    std::ofstream _outfile;
-    size_t _n_messages;
+    // FIFO broadcast config only, runs on top of _pl.
+    FifoBroadcast *_fifo{nullptr};
+    // Lattice agreement config only, runs on top of _pl.
+    LatticeAgreement *_lattice{nullptr};
+    LogWriter _log;
+    const size_t _n_messages;
+    std::atomic<size_t> _n_delivered{0};
+    std::atomic<bool> _stopping{false};
+    std::chrono::steady_clock::time_point _stop_requested_at;
     std::atomic<bool> _stop{false};
     std::mutex _stop_mutex;
     std::condition_variable _stop_cv;
 
+    static EventLoopMode event_loop_mode();
+    static OutputMode output_mode();
+    void print_stats();
     void run_sender(const Config& cfg);
     void run_receiver(const Config& cfg);
-    static void sender_deliver_callback(const Packet& pkt);
-    void receiver_deliver_callback(const Packet& pkt);
+    static size_t expected_messages(const Config& cfg, size_t n_processes);
+    static void sender_deliver_callback(const PacketView& pkt);
+    void receiver_deliver_callback(const PacketView& pkt);
 };
 
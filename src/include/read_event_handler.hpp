@@ -1,19 +1,55 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <mutex>
 #include <utility>
 #include "udp_socket.hpp"
 #include "event_loop.hpp"
 #include "packet.hpp"
 
-using DeliverCallback = std::function<void(const Packet& pkt)>;
+using DeliverCallback = std::function<void(const PacketView& pkt)>;
+// Receives every decoded datagram together with the address it came from.
+using PacketCallback = std::function<void(const PacketView& pkt, const struct sockaddr_in& source)>;
+using BatchEndCallback = std::function<void()>;
+
+// Maximum number of datagrams pulled from the socket with a single recvmmsg().
+constexpr static size_t DEFAULT_RECV_BATCH_SIZE = 64;
+
+struct RecvStats {
+    uint64_t syscalls;
+    uint64_t datagrams;
+};
 
 class ReadEventHandler {
 public:
-    ReadEventHandler(UDPSocket *socket, DeliverCallback process_pkt_callback);
+    ReadEventHandler(UDPSocket *socket, PacketCallback process_pkt_callback,
+                     BatchEndCallback batch_end_callback = nullptr,
+                     size_t batch_size = DEFAULT_RECV_BATCH_SIZE);
     void handle_read_event(uint32_t events);
+    // Entry points for backends that receive on their own, such as io_uring.
+    // Called from a single thread at a time.
+    void handle_datagram(const uint8_t *data, size_t len, bool truncated,
+                         const struct sockaddr_in& source);
+    void end_batch();
+    RecvStats stats() const;
 
 private:
     UDPSocket *_socket;
-    DeliverCallback _process_pkt_callback;
+    PacketCallback _process_pkt_callback;
+    // Invoked once every packet of a recvmmsg() batch has been processed.
+    BatchEndCallback _batch_end_callback;
+    // Two workers never run handle_read_event() at once. With SHARED_ONESHOT
+    // the fd is rearmed only after the handler returns, but the next event
+    // may go to another worker. With PER_THREAD_EDGE the fd sits in the
+    // epoll instance of one worker, which is the only one to read it, and
+    // the edge-triggered handler drains it on every event. IO_URING calls
+    // handle_datagram() directly and leaves _batch alone. The mutex is thus
+    // never contended, it publishes the reused batch buffers from one worker
+    // to the next in SHARED_ONESHOT mode, and keeps them safe should the fd
+    // ever be watched by more than one worker.
+    std::mutex _batch_mutex;
+    RecvBatch _batch;
+    std::atomic<uint64_t> _recv_syscalls{0};
+    std::atomic<uint64_t> _recv_datagrams{0};
 };
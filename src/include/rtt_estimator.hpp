@@ -0,0 +1,27 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Retransmission timeout from smoothed RTT samples (Jacobson/Karels, as in
+// RFC 6298). Backoff is applied per packet: a packet that has already been
+// sent n times waits rto * 2^(n-1) before its next retransmission.
+class RttEstimator {
+public:
+    using duration = std::chrono::microseconds;
+
+    constexpr static duration INITIAL_RTO{std::chrono::milliseconds(50)};
+    constexpr static duration MIN_RTO{std::chrono::milliseconds(20)};
+    constexpr static duration MAX_RTO{std::chrono::milliseconds(1000)};
+
+    void sample(duration rtt);
+    duration rto() const;
+    duration rto(uint32_t transmissions) const;
+    duration srtt() const;
+
+private:
+    bool _has_sample = false;
+    duration _srtt{0};
+    duration _rttvar{0};
+    duration _rto{INITIAL_RTO};
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class SlotState : uint8_t {
+    FREE,
+    IN_FLIGHT,
+    ACKED,
+};
+
+struct SendSlot {
+    SlotState state;
+    // Header flags the packet is sent with.
+    uint8_t flags;
+    uint32_t seq_id;
+    uint32_t data_size;
+    uint32_t transmissions;
+    std::chrono::steady_clock::time_point sent_at;
+};
+
+// What a batch of acknowledgements retired. Following Karn's rule, only
+// packets that were transmitted exactly once may provide an RTT sample.
+struct AckSample {
+    uint32_t acked = 0;
+    bool has_rtt_sample = false;
+    std::chrono::steady_clock::time_point latest_sent_at{};
+};
+
+// Fixed-capacity circular window of outgoing DATA packets. Sequence ids are
+// assigned consecutively and live in slot seq_id % capacity, with their
+// payloads stored inline in a slab, so acknowledging a packet or scanning
+// the window never allocates and never walks a tree.
+class SendWindow {
+private:
+    uint32_t _capacity;
+    uint32_t _mask;
+    size_t _max_data_size;
+    std::vector<SendSlot> _slots;
+    std::vector<uint8_t> _slab;
+    // Oldest sequence id that has not been retired yet.
+    uint32_t _base;
+    // Sequence id the next push() assigns.
+    uint32_t _next;
+    // Slots in [_base, _next) that are still IN_FLIGHT.
+    uint32_t _outstanding;
+
+    SendSlot& slot(uint32_t seq_id);
+    const SendSlot& slot(uint32_t seq_id) const;
+    void retire();
+    void record(const SendSlot& s, AckSample& sample) const;
+
+public:
+    SendWindow(uint32_t capacity, size_t max_data_size, uint32_t first_seq_id);
+
+    bool full() const;
+    bool empty() const;
+    uint32_t base() const;
+    uint32_t next() const;
+    uint32_t outstanding() const;
+
+    uint8_t *push(uint32_t data_size, uint8_t flags = 0);
+    bool ack(uint32_t seq_id, AckSample& sample);
+    void ack_below(uint32_t seq_id, AckSample& sample);
+    void mark_sent(uint32_t seq_id, std::chrono::steady_clock::time_point now);
+
+    bool in_flight(uint32_t seq_id) const;
+    const uint8_t *data(uint32_t seq_id) const;
+    uint32_t data_size(uint32_t seq_id) const;
+    uint8_t flags(uint32_t seq_id) const;
+    uint32_t transmissions(uint32_t seq_id) const;
+    std::chrono::steady_clock::time_point sent_at(uint32_t seq_id) const;
+};
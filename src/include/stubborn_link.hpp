@@ -7,51 +7,176 @@
 #include <mutex>
 #include <queue>
 #include <atomic>
-#include <set>
 #include <condition_variable>
 #include <random>
 #include "udp_socket.hpp"
 #include "packet.hpp"
+#include "payload_codec.hpp"
 #include "event_loop.hpp"
 #include "parser.hpp"
 #include "read_event_handler.hpp"
+#include "ack_window.hpp"
+#include "send_window.hpp"
+#include "rtt_estimator.hpp"
+#include "congestion_window.hpp"
+#include "log_writer.hpp"
 
-using DeliverCallback = std::function<void(const Packet& pkt)>;
+// Hands a DATA packet to the layer above. Returns false if the packet cannot
+// be taken yet, it is then left unacknowledged and will be retransmitted.
+using AcceptCallback = std::function<bool(const PacketView& pkt)>;
+// Writes the payload of the next DATA packet, in the given wire format, to
+// data, which holds the link's max_data_size bytes, and sets its flags.
+// Returns 0 if there is nothing to send for now. Called with the link's lock
+// held.
+using PacketSource = std::function<size_t(WireFormat format, uint8_t *data, uint8_t& flags)>;
+// Writes the payload of an ACK_VECTOR frame, at most capacity bytes, or
+// returns 0 if there is none to send. standalone tells whether the frame
+// would take a datagram of its own instead of riding along with DATA frames.
+using AckVectorSource = std::function<size_t(uint8_t *data, size_t capacity, bool standalone)>;
+using AckVectorCallback = std::function<void(const PacketView& pkt)>;
 
-//constexpr int sliding_window_size = 32;
+// Upper bound for the congestion window. The receiver's SACK bitmap has to be
+// able to describe the whole window.
+constexpr uint32_t max_window_size = SACK_WINDOW_BITS;
+// SACK payload: advertised receive window, then the out-of-order bitmap.
+constexpr size_t SACK_RWND_SIZE = sizeof(uint16_t);
+// Packets from a PacketSource may prefix the messages with a varint of their
+// own.
+constexpr size_t MAX_DATA_SIZE = MAX_VARINT32_SIZE + MESSAGES_PER_PACKET * sizeof(uint32_t);
+constexpr size_t MAX_DATA_PACKET_SIZE = HEADER_SIZE + MAX_DATA_SIZE;
+// Largest payload a link can be set up for: a packet that fills a datagram
+// on its own, whatever the header format. Links with larger packets get
+// fewer of them in flight, about as many bytes as MAX_DATA_SIZE ones.
+constexpr size_t MAX_LINK_DATA_SIZE = MAX_DATAGRAM_SIZE - HEADER_SIZE;
+// SYNs are repeated at this interval until the peer answers. Links that
+// send their own SYNs double it each time up to MAX_SYN_INTERVAL: a peer
+// that starts late connects the link with its own SYN.
+constexpr std::chrono::milliseconds SYN_INTERVAL{50};
+constexpr std::chrono::milliseconds MAX_SYN_INTERVAL{1000};
 
+struct SendStats {
+    RttEstimator::duration rto;
+    uint32_t cwnd;
+    uint64_t transmissions;
+    uint64_t retransmissions;
+    // DATA datagrams, fewer than transmissions once packets are coalesced.
+    uint64_t datagrams;
+    // Datagrams of SYN, ACK, SACK or ACK_VECTOR frames only.
+    uint64_t control_datagrams;
+};
+
+// Wakes the thread sending on a set of links once one of them has room in its
+// window again, or has something new to send.
+class SendSignal {
+private:
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _raised{false};
+
+public:
+  void raise();
+  // Returns at the deadline or once raised, and clears the signal.
+  void wait_until(std::chrono::steady_clock::time_point deadline);
+};
+
+enum class SendStep {
+  // The window went out, the link needs attention again by the deadline.
+  SENT,
+  // The socket buffer is full, retry after a backoff.
+  BLOCKED,
+  // Nothing in flight and nothing to send.
+  IDLE,
+  // No SYN or SYN_ACK from the peer yet.
+  CONNECTING,
+  STOPPED
+};
+
+// Per-peer link state. All links of a process share the PerfectLink's socket,
+// which demultiplexes incoming packets to process_packet().
 class StubbornLink {
 public:
-  StubbornLink(uint64_t pid, in_addr_t addr, uint16_t port,
-               in_addr_t paddr, uint16_t pport,
-               bool sender, EventLoop &event_loop, DeliverCallback _deliver_cb);
+  StubbornLink(uint64_t pid, UDPSocket &socket, in_addr_t paddr, uint16_t pport,
+               bool sender, uint32_t advertised_window, SendSignal &send_signal,
+               AcceptCallback accept_cb, PacketSource source = nullptr,
+               AckVectorSource ack_vector_source = nullptr, AckVectorCallback ack_vector_cb = nullptr,
+               size_t max_data_size = MAX_DATA_SIZE);
 
-  void send(uint32_t n_messages, std::ofstream &outfile, std::mutex &outfile_mutex);
+  void send(uint32_t n_messages, LogWriter &log);
+  // One pass of the send loop without blocking: top up the window, serialize
+  // what is due and flush it. Lowers next_deadline to when the link next
+  // needs attention. A link that has not heard from its peer yet sends SYNs
+  // instead.
+  SendStep send_step(LogWriter &log, std::chrono::steady_clock::time_point &next_deadline);
   bool send_syn_packet();
   void stop();
+  SendStats send_stats();
+  bool is_peer(const struct sockaddr_in& addr) const;
+  // Receiver side, called from the read event handler.
+  void process_packet(const PacketView &pkt);
+  bool sack_pending() const;
+  void flush_sack();
 private:
-  UDPSocket _socket;
+  UDPSocket &_socket;
+  struct sockaddr_in _peer_addr{};
   bool _sender;
-  std::set<Packet, PacketLess> unacked_packets;
-  std::condition_variable _resend_cv;
-  DeliverCallback _deliver_cb;
+  const size_t _max_data_size;
+  SendWindow _send_window;
+  RttEstimator _rtt;
+  CongestionWindow _cwnd{max_window_size};
+  // Raised by ACK processing to wake the sender before its next timer
+  // expires. Shared by all links of a PerfectLink.
+  SendSignal &_send_signal;
+  // When the earliest packet left out of the last batch expires.
+  std::chrono::steady_clock::time_point _next_deadline;
+  std::chrono::steady_clock::time_point _next_syn;
+  std::chrono::milliseconds _syn_interval{SYN_INTERVAL};
+  std::atomic<uint64_t> _transmissions{0};
+  std::atomic<uint64_t> _retransmissions{0};
+  std::atomic<uint64_t> _datagrams{0};
+  std::atomic<uint64_t> _control_datagrams{0};
+  // Messages are turned into packets only when they enter the window.
+  uint64_t _n_messages{0};
+  uint64_t _next_message{1};
+  SendBatch _send_batch;
+  AcceptCallback _accept_cb;
+  // Fills the window instead of the message counter if set.
+  PacketSource _source;
+  AckVectorSource _ack_vector_source;
+  AckVectorCallback _ack_vector_cb;
+  // Bytes in the coalesced datagram the last batch ends with, 0 if it is
+  // closed.
+  size_t _open_datagram{0};
   uint64_t _pid;
-  ReadEventHandler *_read_event_handler;
-  EventData _read_event_data{};
-
 
   std::condition_variable _syn_received_cv;
   std::mutex _syn_mutex;
   std::atomic<bool> _syn_received{false};
   std::mutex _unacked_mutex;
-  std::thread _resend_thread;
-  std::thread _syn_resend_thread;
   std::atomic<bool> _stop;
   std::atomic<bool> _syn_ack_received{false};
+  // Format used for everything this link sends once the handshake has picked
+  // one. SYN and SYN_ACK always go out in the legacy format.
+  std::atomic<WireFormat> _wire_format{WireFormat::LEGACY};
+  // Receiver side, only touched from the read event handler. Peers that
+  // negotiated the compact format get one SACK per receive batch instead of
+  // one ACK per DATA packet.
+  AckWindow _ack_window{1};
+  bool _sack_pending{false};
+  // Receive window advertised in every SACK, in packets.
+  uint32_t _advertised_window;
   std::default_random_engine _random_engine{std::random_device{}()};
 
-  void send_unacked_messages();
-  void process_packet(const Packet &pkt);
-  void store_and_output_messages(uint32_t n_messages, std::ofstream &outfile, std::mutex &outfile_mutex);
+  void send_unacked_messages(LogWriter &log);
+  bool connected() const;
+  void process_sack(const PacketView &pkt);
+  void on_acked(const AckSample& sample);
+  std::chrono::steady_clock::time_point fill_send_batch();
+  bool append_ack_vector();
+  void send_ack_vector();
+  void send_control_packet(const PacketHeader& header, const uint8_t *data = nullptr,
+                           WireFormat format = WireFormat::LEGACY);
+  static WireFormat negotiate_wire_format(const PacketView& pkt);
+  static uint32_t window_capacity(size_t max_data_size);
+  void fill_window(LogWriter &log);
   int backoff_interval(int timeout);
 };
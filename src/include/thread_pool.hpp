@@ -3,25 +3,155 @@
 #include <iostream>
 #include <vector>
 #include <thread>
-#include <queue>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
 #include <future>
 #include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
 
+// Threads a process may run at once: the main thread and those of every
+// pool, pinned ones included.
+constexpr static size_t THREAD_BUDGET = 8;
+// Callables up to this size are stored inside the Task, larger ones on the
+// heap.
+constexpr static size_t TASK_INLINE_SIZE = 48;
+
+// Move-only void() callable with small-buffer storage, so enqueueing a
+// lambda that captures a few pointers does not allocate.
+class Task {
+private:
+    struct Ops {
+        void (*invoke)(void *storage);
+        void (*move)(void *dst, void *src);
+        void (*destroy)(void *storage);
+    };
+
+    template <typename F>
+    static constexpr bool stored_inline = sizeof(F) <= TASK_INLINE_SIZE &&
+                                          alignof(F) <= alignof(std::max_align_t) &&
+                                          std::is_nothrow_move_constructible<F>::value;
+
+    template <typename F>
+    static const Ops *inline_ops() {
+      static const Ops ops{
+          [](void *s) { (*static_cast<F *>(s))(); },
+          [](void *dst, void *src) {
+            new (dst) F(std::move(*static_cast<F *>(src)));
+            static_cast<F *>(src)->~F();
+          },
+          [](void *s) { static_cast<F *>(s)->~F(); }};
+      return &ops;
+    }
+
+    template <typename F>
+    static const Ops *heap_ops() {
+      static const Ops ops{
+          [](void *s) { (**static_cast<F **>(s))(); },
+          [](void *dst, void *src) { *static_cast<F **>(dst) = *static_cast<F **>(src); },
+          [](void *s) { delete *static_cast<F **>(s); }};
+      return &ops;
+    }
+
+    alignas(std::max_align_t) unsigned char _storage[TASK_INLINE_SIZE];
+    const Ops *_ops{nullptr};
+
+public:
+    Task() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, Task>::value>>
+    Task(F&& f) {
+      using Fn = std::decay_t<F>;
+      if constexpr (stored_inline<Fn>) {
+        new (_storage) Fn(std::forward<F>(f));
+        _ops = inline_ops<Fn>();
+      } else {
+        *reinterpret_cast<Fn **>(_storage) = new Fn(std::forward<F>(f));
+        _ops = heap_ops<Fn>();
+      }
+    }
+
+    Task(Task&& other) noexcept : _ops(other._ops) {
+      if (_ops != nullptr) {
+        _ops->move(_storage, other._storage);
+        other._ops = nullptr;
+      }
+    }
+
+    Task& operator=(Task&& other) noexcept {
+      if (this != &other) {
+        reset();
+        _ops = other._ops;
+        if (_ops != nullptr) {
+          _ops->move(_storage, other._storage);
+          other._ops = nullptr;
+        }
+      }
+      return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+      reset();
+    }
+
+    void reset() {
+      if (_ops != nullptr) {
+        _ops->destroy(_storage);
+        _ops = nullptr;
+      }
+    }
+
+    explicit operator bool() const {
+      return _ops != nullptr;
+    }
+
+    void operator()() {
+      _ops->invoke(_storage);
+    }
+};
+
+// Work-stealing pool. Every worker owns a deque: it pops its own tasks from
+// the back and steals from the front of the others' when it runs dry.
+// Endless loops go to pinned threads instead, which never take tasks.
 class ThreadPool {
 public:
+    // num_threads task workers, none if nothing is ever enqueued.
     explicit ThreadPool(size_t num_threads);
 
     void stop();
-    void enqueue(std::function<void()> task);
+    void enqueue(Task task);
+    void pin(Task loop);
 private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
     std::vector<std::thread> _workers;
-    std::queue<std::function<void()>> _task_queue;
-    std::mutex _queue_mutex;
+    std::vector<std::thread> _pinned;
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::atomic<size_t> _next_queue{0};
+    // Tasks enqueued and not yet taken, counted before they are pushed.
+    // Incremented under _sleep_mutex so idle workers cannot miss a wakeup.
+    std::atomic<size_t> _pending{0};
+    std::mutex _sleep_mutex;
     std::condition_variable cv;
     std::atomic<bool> _stop_threads;
+    size_t _reserved{0};
+
+    // Counts the main thread from the start.
+    static std::atomic<size_t> _threads_in_use;
 
-    void worker_function();
+    void reserve_threads(size_t n);
+    bool pop(size_t index, Task &task);
+    bool steal(size_t index, Task &task);
+    void worker_function(size_t index);
 };
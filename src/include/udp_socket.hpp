@@ -5,7 +5,61 @@
 #include <sys/socket.h>
 
 constexpr static int RECV_BUF_SIZE = 65536;
+// Size of a single receive slot in a RecvBatch. Our datagrams are far smaller
+// than RECV_BUF_SIZE, so the batch slots are sized to keep the ring compact.
+constexpr static size_t RECV_SLOT_SIZE = 2048;
+// Rough kernel memory charged against SO_RCVBUF for one small queued datagram.
+constexpr static size_t RECV_DATAGRAM_TRUESIZE = 1024;
 
+// Preallocated set of buffers filled by a single recvmmsg() call.
+class RecvBatch {
+private:
+    size_t _slot_size;
+    std::vector<uint8_t> _storage;
+    std::vector<struct iovec> _iovecs;
+    std::vector<struct sockaddr_in> _sources;
+    std::vector<struct mmsghdr> _msgs;
+
+public:
+    RecvBatch(size_t batch_size, size_t slot_size = RECV_SLOT_SIZE);
+
+    size_t size() const;
+    struct mmsghdr *msgs();
+    const uint8_t *data(size_t i) const;
+    size_t len(size_t i) const;
+    bool truncated(size_t i) const;
+    const struct sockaddr_in& source(size_t i) const;
+    void reset();
+};
+
+// Contiguous arena of serialized datagrams flushed with sendmmsg(). The
+// datagrams that have not been sent yet stay queued, so a flush interrupted by
+// EWOULDBLOCK resumes from the first unsent datagram.
+class SendBatch {
+private:
+    std::vector<uint8_t> _arena;
+    size_t _arena_used;
+    std::vector<struct iovec> _iovecs;
+    std::vector<struct mmsghdr> _msgs;
+    size_t _count;
+    size_t _next;
+
+public:
+    SendBatch(size_t max_datagrams, size_t arena_size);
+
+    uint8_t *tail();
+    size_t available() const;
+    bool full() const;
+    void commit(size_t len, const struct sockaddr_in *dest);
+    void extend(size_t len);
+    size_t pending() const;
+    struct mmsghdr *pending_msgs();
+    void advance(size_t n);
+    void clear();
+};
+
+// A single unconnected socket per process: every peer is reached with
+// sendto()/sendmmsg() and every datagram is received from the same fd.
 class UDPSocket {
 private:
     int _infd;
@@ -20,7 +74,9 @@ public:
     void set_blocking_output(bool blocking) const;
     int infd() const;
     int outfd() const;
-    void conn(const struct sockaddr_in& addr);
-    ssize_t send_buf(const std::vector<uint8_t>& buffer) const;
-    ssize_t recv_buf(std::vector<uint8_t>& buffer) const;
+    size_t recv_capacity() const;
+    void set_recv_buffer_size(int size) const;
+    ssize_t send_to(const uint8_t *buffer, size_t size, const struct sockaddr_in& dest) const;
+    int recv_batch(RecvBatch& batch) const;
+    int send_batch(SendBatch& batch) const;
 };
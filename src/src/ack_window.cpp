@@ -0,0 +1,62 @@
+#include <algorithm>
+#include <cstring>
+#include "ack_window.hpp"
+
+AckWindow::AckWindow(uint32_t first_seq_id)
+    : _cumulative(first_seq_id), _highest(first_seq_id) {}
+
+bool AckWindow::test(uint32_t seq_id) const {
+  uint32_t idx = seq_id % SACK_WINDOW_BITS;
+  return (_bits[idx / 64] >> (idx % 64)) & 1U;
+}
+
+void AckWindow::set(uint32_t seq_id) {
+  uint32_t idx = seq_id % SACK_WINDOW_BITS;
+  _bits[idx / 64] |= uint64_t{1} << (idx % 64);
+}
+
+void AckWindow::clear(uint32_t seq_id) {
+  uint32_t idx = seq_id % SACK_WINDOW_BITS;
+  _bits[idx / 64] &= ~(uint64_t{1} << (idx % 64));
+}
+
+// Returns true if seq_id had not been recorded before. Ids too far ahead of
+// the cumulative ACK are not recorded, the sender will retransmit them.
+bool AckWindow::mark(uint32_t seq_id) {
+  if (seq_id < _cumulative || seq_id - _cumulative >= SACK_WINDOW_BITS || test(seq_id)) {
+    return false;
+  }
+  set(seq_id);
+  _highest = std::max(_highest, seq_id);
+  while (test(_cumulative)) {
+    clear(_cumulative);
+    _cumulative++;
+  }
+  _highest = std::max(_highest, _cumulative);
+  return true;
+}
+
+// Everything strictly below the returned id has been received.
+uint32_t AckWindow::cumulative() const {
+  return _cumulative;
+}
+
+// Writes the out-of-order bitmap and returns its length in bytes, trailing
+// zero bytes are not written.
+size_t AckWindow::encode_bitmap(uint8_t *buffer, size_t capacity) const {
+  if (_highest <= _cumulative) {
+    return 0;
+  }
+  size_t size = std::min(static_cast<size_t>((_highest - _cumulative - 1) / 8 + 1), capacity);
+  std::memset(buffer, 0, size);
+  for (uint32_t seq_id = _cumulative + 1; seq_id <= _highest; seq_id++) {
+    size_t i = seq_id - _cumulative - 1;
+    if (i / 8 >= size) {
+      break;
+    }
+    if (test(seq_id)) {
+      buffer[i / 8] = static_cast<uint8_t>(buffer[i / 8] | (1U << (i % 8)));
+    }
+  }
+  return size;
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <new>
+#include "buffer_pool.hpp"
+
+static std::atomic<uint64_t> next_pool_id{1};
+
+BufferPool::BufferPool(size_t buffer_size)
+        : _buffer_size(std::max(buffer_size, sizeof(Buffer))), _id(next_pool_id.fetch_add(1)) {
+}
+
+// Buffers still taken are the caller's to free.
+BufferPool::~BufferPool() {
+  size_t n_caches = std::min(_n_caches.load(), MAX_POOL_THREADS);
+  for (size_t i = 0; i < n_caches; i++) {
+    ThreadCache *cache = _caches[i].load();
+    if (cache != nullptr) {
+      free_list(cache->head);
+      delete cache;
+    }
+  }
+  free_list(_shared);
+}
+
+void BufferPool::free_list(Buffer *buffers) {
+  while (buffers != nullptr) {
+    Buffer *next = buffers->next;
+    ::operator delete(buffers);
+    buffers = next;
+  }
+}
+
+// nullptr once MAX_POOL_THREADS threads have a cache.
+BufferPool::ThreadCache *BufferPool::thread_cache() {
+  thread_local uint64_t owner = 0;
+  thread_local ThreadCache *cache = nullptr;
+  if (owner == _id) {
+    return cache;
+  }
+  owner = _id;
+  cache = nullptr;
+  size_t index = _n_caches.fetch_add(1);
+  if (index < MAX_POOL_THREADS) {
+    cache = new ThreadCache();
+    _caches[index].store(cache);
+  }
+  return cache;
+}
+
+void BufferPool::refill(ThreadCache *cache) {
+  std::lock_guard<std::mutex> lock(_shared_mutex);
+  while (_shared != nullptr && cache->count < POOL_BATCH) {
+    Buffer *buffer = _shared;
+    _shared = buffer->next;
+    buffer->next = cache->head;
+    cache->head = buffer;
+    cache->count++;
+  }
+  if (cache->count > 0) {
+    _refills.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void BufferPool::spill(ThreadCache *cache) {
+  std::lock_guard<std::mutex> lock(_shared_mutex);
+  for (size_t i = 0; i < POOL_BATCH; i++) {
+    Buffer *buffer = cache->head;
+    cache->head = buffer->next;
+    cache->count--;
+    buffer->next = _shared;
+    _shared = buffer;
+  }
+}
+
+void *BufferPool::allocate() {
+  _heap_allocs.fetch_add(1, std::memory_order_relaxed);
+  return ::operator new(_buffer_size);
+}
+
+void *BufferPool::take() {
+  ThreadCache *cache = thread_cache();
+  if (cache == nullptr) {
+    _shared_takes.fetch_add(1, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(_shared_mutex);
+      if (_shared != nullptr) {
+        Buffer *buffer = _shared;
+        _shared = buffer->next;
+        return buffer;
+      }
+    }
+    return allocate();
+  }
+
+  cache->takes.fetch_add(1, std::memory_order_relaxed);
+  if (cache->count == 0) {
+    refill(cache);
+    if (cache->count == 0) {
+      return allocate();
+    }
+  }
+  Buffer *buffer = cache->head;
+  cache->head = buffer->next;
+  cache->count--;
+  return buffer;
+}
+
+void BufferPool::give(void *buffer) {
+  auto *node = static_cast<Buffer *>(buffer);
+  ThreadCache *cache = thread_cache();
+  if (cache == nullptr) {
+    std::lock_guard<std::mutex> lock(_shared_mutex);
+    node->next = _shared;
+    _shared = node;
+    return;
+  }
+
+  node->next = cache->head;
+  cache->head = node;
+  cache->count++;
+  if (cache->count > POOL_CACHE_LIMIT) {
+    spill(cache);
+  }
+}
+
+size_t BufferPool::buffer_size() const {
+  return _buffer_size;
+}
+
+BufferPoolStats BufferPool::stats() const {
+  uint64_t takes = _shared_takes.load(std::memory_order_relaxed);
+  size_t n_caches = std::min(_n_caches.load(), MAX_POOL_THREADS);
+  for (size_t i = 0; i < n_caches; i++) {
+    ThreadCache *cache = _caches[i].load();
+    if (cache != nullptr) {
+      takes += cache->takes.load(std::memory_order_relaxed);
+    }
+  }
+  return {takes, _heap_allocs.load(std::memory_order_relaxed), _refills.load(std::memory_order_relaxed)};
+}
@@ -1,6 +1,16 @@
+#include <algorithm>
+#include <cassert>
 #include "config.hpp"
 
-Config::Config(uint32_t num_messages, uint32_t receiver_proc) : _num_messages(num_messages), _receiver_proc(receiver_proc) {}
+Config::Config(uint32_t num_messages, uint32_t receiver_proc) : _kind(ConfigKind::PERFECT_LINKS), _num_messages(num_messages), _receiver_proc(receiver_proc), _max_values(0), _max_distinct(0) {}
+
+Config::Config(uint32_t num_messages) : _kind(ConfigKind::FIFO_BROADCAST), _num_messages(num_messages), _receiver_proc(0), _max_values(0), _max_distinct(0) {}
+
+Config::Config(uint32_t n_proposals, uint32_t max_values, uint32_t max_distinct) : _kind(ConfigKind::LATTICE_AGREEMENT), _num_messages(n_proposals), _receiver_proc(0), _max_values(max_values), _max_distinct(max_distinct) {}
+
+ConfigKind Config::kind() const {
+  return _kind;
+}
 
 uint32_t Config::num_messages() const {
   return _num_messages;
@@ -9,3 +19,28 @@ uint32_t Config::num_messages() const {
 uint32_t Config::receiver_proc() const {
   return _receiver_proc;
 }
+
+void Config::add_proposal(std::vector<uint32_t> values) {
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+  _values.insert(_values.end(), values.begin(), values.end());
+  _offsets.push_back(_values.size());
+}
+
+uint32_t Config::n_proposals() const {
+  return _num_messages;
+}
+
+uint32_t Config::max_values() const {
+  return _max_values;
+}
+
+uint32_t Config::max_distinct() const {
+  return _max_distinct;
+}
+
+std::vector<uint32_t> Config::proposal(uint32_t shot) const {
+  assert(shot + 1 < _offsets.size());
+  return {_values.begin() + static_cast<std::ptrdiff_t>(_offsets[shot]),
+          _values.begin() + static_cast<std::ptrdiff_t>(_offsets[shot + 1])};
+}
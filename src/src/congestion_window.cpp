@@ -0,0 +1,41 @@
+#include <algorithm>
+#include "congestion_window.hpp"
+
+CongestionWindow::CongestionWindow(uint32_t max_cwnd)
+    : _max_cwnd(max_cwnd), _cwnd(std::min(INITIAL_CWND, max_cwnd)),
+      _ssthresh(max_cwnd), _rwnd(max_cwnd) {}
+
+void CongestionWindow::on_ack(uint32_t acked) {
+  if (_cwnd < _ssthresh) {
+    _cwnd = std::min(_cwnd + acked, _max_cwnd);
+    return;
+  }
+  _acked_in_round += acked;
+  if (_acked_in_round >= _cwnd) {
+    _acked_in_round -= _cwnd;
+    _cwnd = std::min(_cwnd + 1, _max_cwnd);
+  }
+}
+
+// seq_id timed out while next_seq_id was the next sequence id to be sent.
+void CongestionWindow::on_loss(uint32_t seq_id, uint32_t next_seq_id) {
+  if (seq_id < _recovery_point) {
+    return;
+  }
+  _ssthresh = std::max(_cwnd * 7 / 10, MIN_CWND);
+  _cwnd = _ssthresh;
+  _acked_in_round = 0;
+  _recovery_point = next_seq_id;
+}
+
+void CongestionWindow::set_receiver_window(uint32_t rwnd) {
+  _rwnd = std::max(rwnd, uint32_t{1});
+}
+
+uint32_t CongestionWindow::cwnd() const {
+  return _cwnd;
+}
+
+uint32_t CongestionWindow::window() const {
+  return std::min(_cwnd, _rwnd);
+}
@@ -0,0 +1,71 @@
+#include "delivered_window.hpp"
+
+static uint64_t make_word(uint32_t block, uint32_t bits) {
+  return static_cast<uint64_t>(block) << 32 | bits;
+}
+
+static uint32_t word_block(uint64_t word) {
+  return static_cast<uint32_t>(word >> 32);
+}
+
+static uint32_t word_bits(uint64_t word) {
+  return static_cast<uint32_t>(word);
+}
+
+bool DeliveredWindow::test(uint32_t seq_id) const {
+  uint32_t block = seq_id / DELIVERED_WORD_BITS;
+  uint64_t word = _words[block % DELIVERED_WINDOW_WORDS].load();
+  return word_block(word) == block && (word_bits(word) >> (seq_id % DELIVERED_WORD_BITS)) & 1U;
+}
+
+// Returns DELIVER exactly once per seq_id, no matter how many threads race on
+// it. Ids whose block does not fit in the ring yet are rejected, the sender
+// has to retransmit them.
+MarkResult DeliveredWindow::mark(uint32_t seq_id) {
+  uint32_t watermark = _watermark.load();
+  if (seq_id <= watermark) {
+    return MarkResult::DUPLICATE;
+  }
+  uint32_t block = seq_id / DELIVERED_WORD_BITS;
+  if (block - (watermark + 1) / DELIVERED_WORD_BITS >= DELIVERED_WINDOW_WORDS) {
+    return MarkResult::OUT_OF_WINDOW;
+  }
+
+  auto& slot = _words[block % DELIVERED_WINDOW_WORDS];
+  uint32_t bit = uint32_t{1} << (seq_id % DELIVERED_WORD_BITS);
+  uint64_t word = slot.load();
+  while (true) {
+    if (word_block(word) > block) {
+      // The slot moved on, so the watermark has passed this id.
+      return MarkResult::DUPLICATE;
+    }
+    // An older block in the slot lies entirely below the watermark.
+    uint32_t bits = word_block(word) == block ? word_bits(word) : 0;
+    if (bits & bit) {
+      return MarkResult::DUPLICATE;
+    }
+    if (slot.compare_exchange_weak(word, make_word(block, bits | bit))) {
+      break;
+    }
+  }
+  advance();
+  return MarkResult::DELIVER;
+}
+
+// Moves the watermark over the contiguous run of delivered ids above it.
+// Whoever marks the id right above the watermark last sees every earlier mark,
+// so the watermark never stalls.
+void DeliveredWindow::advance() {
+  uint32_t watermark = _watermark.load();
+  while (test(watermark + 1)) {
+    // On failure watermark is reloaded and the scan resumes from there.
+    if (_watermark.compare_exchange_weak(watermark, watermark + 1)) {
+      watermark++;
+    }
+  }
+}
+
+// Every seq_id up to and including the watermark has been delivered.
+uint32_t DeliveredWindow::watermark() const {
+  return _watermark.load();
+}
@@ -1,49 +1,128 @@
+#include <algorithm>
 #include <iostream>
 #include <utility>
 #include <unistd.h>
 #include <cassert>
 #include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <cstring>
 #include "event_loop.hpp"
 #include "stubborn_link.hpp"
 
-EventLoop::EventLoop() : _running(true) {
-  _epoll_fd = epoll_create1(0);
-  if (_epoll_fd == -1) {
-    perror("epoll_create1 failed");
-    exit(EXIT_FAILURE);
-  }
+// Receive buffers provided to io_uring. A buffer holds the recvmsg header,
+// the source address and the datagram.
+constexpr static uint32_t URING_ENTRIES = 64;
+constexpr static uint32_t URING_CQ_ENTRIES = 4096;
+constexpr static uint16_t URING_BUFFERS = 1024;
+constexpr static size_t URING_BUFFER_SIZE = RECV_SLOT_SIZE;
 
+EventLoop::EventLoop(EventLoopMode mode, size_t n_workers) : _mode(mode), _running(true) {
   // Create the wakeup event file descriptor
   _exit_loop_fd = eventfd(0, 0);
   if (_exit_loop_fd == -1) {
     perror("eventfd failed");
-    close(_epoll_fd);
     exit(EXIT_FAILURE);
   }
+  _exit_loop_data.fd = _exit_loop_fd;
+
+  if (_mode == EventLoopMode::IO_URING) {
+    _uring = IoUring::create(URING_ENTRIES, URING_CQ_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+    if (_uring != nullptr) {
+      _uring_recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+      uring_arm_poll(&_exit_loop_data);
+      return;
+    }
+    std::cerr << "io_uring unavailable, falling back to per-thread epoll" << std::endl;
+    _mode = EventLoopMode::PER_THREAD_EDGE;
+  }
+
+  size_t n_instances = _mode == EventLoopMode::SHARED_ONESHOT ? 1 : std::max<size_t>(n_workers, 1);
+  for (size_t i = 0; i < n_instances; i++) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+      perror("epoll_create1 failed");
+      exit(EXIT_FAILURE);
+    }
+    _epoll_fds.push_back(epoll_fd);
+  }
 
   // Add the wakeup file descriptor to epoll for monitoring
-  _exit_loop_data.fd = _exit_loop_fd;
-  add(EPOLLIN, &_exit_loop_data);
+  if (_mode == EventLoopMode::SHARED_ONESHOT) {
+    register_fd(_epoll_fds[0], EPOLLIN | EPOLLONESHOT, &_exit_loop_data);
+  } else {
+    // Level-triggered and never read, so a single write wakes every worker.
+    for (int epoll_fd : _epoll_fds) {
+      register_fd(epoll_fd, EPOLLIN, &_exit_loop_data);
+    }
+  }
 }
 
 EventLoop::~EventLoop() {
+  _uring.reset();
   close(_exit_loop_fd);
-  close(_epoll_fd);
+  if (_signal_data.fd != -1) {
+    close(_signal_data.fd);
+  }
+  for (int epoll_fd : _epoll_fds) {
+    close(epoll_fd);
+  }
 }
 
-void EventLoop::add(uint32_t events, EventData *event_data) const {
+void EventLoop::register_fd(int epoll_fd, uint32_t events, EventData *event_data) const {
   struct epoll_event ev{};
-  ev.events = events | EPOLLONESHOT;
+  ev.events = events;
   ev.data.ptr = event_data;
-  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, event_data->fd, &ev) == -1) {
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_data->fd, &ev) == -1) {
     perror("epoll_ctl failed");
-    close(_epoll_fd);
-    close(_exit_loop_fd);
     exit(EXIT_FAILURE);
   }
 }
 
+// Must be called before the workers start running.
+void EventLoop::add(uint32_t events, EventData *event_data) {
+  if (_mode == EventLoopMode::IO_URING) {
+    // Submitted by the worker once it starts running.
+    uring_arm_recv(event_data);
+  } else if (_mode == EventLoopMode::SHARED_ONESHOT) {
+    register_fd(_epoll_fds[0], events | EPOLLONESHOT, event_data);
+  } else {
+    // The handler drains the fd on every event, so edge-triggered
+    // notifications are enough and the fd never has to be rearmed.
+    register_fd(_epoll_fds[_next_owner++ % _epoll_fds.size()], events | EPOLLET, event_data);
+  }
+}
+
+// Delivers the given signals to on_signal on a worker thread, through a
+// signalfd, so it runs as ordinary code instead of a signal handler. The
+// signals must be blocked in every thread, or the kernel may still deliver
+// them the usual way. Must be called before the workers start running.
+void EventLoop::watch_signals(const sigset_t& signals, std::function<void(int)> on_signal) {
+  assert(_signal_data.fd == -1);
+  _signal_data.fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (_signal_data.fd == -1) {
+    perror("signalfd failed");
+    exit(EXIT_FAILURE);
+  }
+  _on_signal = std::move(on_signal);
+  if (_mode == EventLoopMode::IO_URING) {
+    uring_arm_poll(&_signal_data);
+  } else if (_mode == EventLoopMode::SHARED_ONESHOT) {
+    register_fd(_epoll_fds[0], EPOLLIN | EPOLLONESHOT, &_signal_data);
+  } else {
+    // Level-triggered in a single instance, only one worker reads it.
+    register_fd(_epoll_fds[0], EPOLLIN, &_signal_data);
+  }
+}
+
+void EventLoop::handle_signals() {
+  struct signalfd_siginfo info{};
+  while (read(_signal_data.fd, &info, sizeof(info)) == sizeof(info)) {
+    _on_signal(static_cast<int>(info.ssi_signo));
+  }
+}
+
 /* From the epoll manual:
  * Since even with edge-triggered epoll (EPOLLET), multiple events can be
  * generated upon receipt of multiple chunks of data, the caller has
@@ -53,22 +132,45 @@ void EventLoop::add(uint32_t events, EventData *event_data) const {
  * specified, it is the caller's responsibility to rearm the file
  * descriptor using epoll_ctl(2) with EPOLL_CTL_MOD.
  * */
-void EventLoop::rearm(uint32_t event, EventData *event_data) const {
+void EventLoop::rearm(uint32_t event, EventData *event_data) {
+  assert(_mode == EventLoopMode::SHARED_ONESHOT);
   epoll_event ev{};
   ev.events = event | EPOLLONESHOT;
   ev.data.ptr = event_data;
-  if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, event_data->fd, &ev) == -1) {
+  _rearms.fetch_add(1, std::memory_order_relaxed);
+  if (epoll_ctl(_epoll_fds[0], EPOLL_CTL_MOD, event_data->fd, &ev) == -1) {
     perror("epoll_ctl rearm failed");
-    close(_epoll_fd);
-    close(_exit_loop_fd);
     exit(EXIT_FAILURE);
   }
 }
 
 void EventLoop::run() {
+  if (_mode == EventLoopMode::SHARED_ONESHOT) {
+    run_instance(_epoll_fds[0]);
+    return;
+  }
+
+  // Every worker claims an epoll instance of its own, the ring goes to the
+  // first one.
+  size_t worker = _next_worker.fetch_add(1);
+  if (_mode == EventLoopMode::IO_URING && worker == 0) {
+    run_uring();
+    return;
+  }
+  if (worker < _epoll_fds.size()) {
+    run_instance(_epoll_fds[worker]);
+    return;
+  }
+  std::unique_lock<std::mutex> lock(_idle_mutex);
+  _idle_cv.wait(lock, [this] { return !_running.load(); });
+}
+
+void EventLoop::run_instance(int epoll_fd) {
+  bool oneshot = _mode == EventLoopMode::SHARED_ONESHOT;
   struct epoll_event events[MAX_EVENTS];
   while (_running) {
-    int nfds = epoll_wait(_epoll_fd, events, MAX_EVENTS, -1);
+    int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    _waits.fetch_add(1, std::memory_order_relaxed);
     if (nfds == -1) {
       if (errno == EINTR) {
         // Received interrupt signal, continue waiting until stop is called.
@@ -80,11 +182,17 @@ void EventLoop::run() {
     for (int i = 0; i < nfds; i++) {
       auto *event_data = static_cast<EventData *>(events[i].data.ptr);
       if (events[i].events & EPOLLERR) {
-        rearm(EPOLLIN, event_data);
+        if (oneshot) {
+          rearm(EPOLLIN, event_data);
+        }
         continue;
       }
 
       if ((events[i].events & EPOLLIN) && event_data->fd == _exit_loop_fd) {
+        if (!oneshot) {
+          // Left readable on purpose, the loop condition ends the worker.
+          continue;
+        }
         uint64_t u;
         // Read to clear the read buffer.
         if (read(_exit_loop_fd, &u, sizeof(u)) == -1) {
@@ -100,16 +208,129 @@ void EventLoop::run() {
         continue;
       }
 
+      if ((events[i].events & EPOLLIN) && event_data == &_signal_data) {
+        handle_signals();
+        if (oneshot) {
+          rearm(EPOLLIN, event_data);
+        }
+        continue;
+      }
+
       // Call the handler
       auto *handler = static_cast<ReadEventHandler *>(event_data->handler_obj);
       handler->handle_read_event(events[i].events);
-      rearm(EPOLLIN, event_data);
+      if (oneshot) {
+        rearm(EPOLLIN, event_data);
+      }
     }
   }
 }
 
+// One io_uring_enter() submits whatever was queued and waits for the next
+// completions. Datagrams are handed to their handler straight from the
+// provided buffers, which go back to the kernel before the next wait.
+void EventLoop::run_uring() {
+  while (_running) {
+    int ret = _uring->submit_and_wait(1);
+    _waits.fetch_add(1, std::memory_order_relaxed);
+    if (ret < 0) {
+      if (ret == -EINTR) {
+        continue;
+      }
+      errno = -ret;
+      perror("io_uring_enter failed");
+      exit(EXIT_FAILURE);
+    }
+    _uring->for_each_cqe([this](const struct io_uring_cqe& cqe) { uring_complete(cqe); });
+    for (auto *handler : _uring_batch_handlers) {
+      handler->end_batch();
+    }
+    _uring_batch_handlers.clear();
+    _uring->publish_buffers();
+  }
+}
+
+void EventLoop::uring_complete(const struct io_uring_cqe& cqe) {
+  auto *event_data = reinterpret_cast<EventData *>(cqe.user_data);
+  if (event_data == &_exit_loop_data) {
+    // The loop condition ends the worker.
+    return;
+  }
+  if (event_data == &_signal_data) {
+    handle_signals();
+    uring_arm_poll(event_data);
+    return;
+  }
+
+  if (cqe.res < 0) {
+    if (cqe.res != -ENOBUFS) {
+      errno = -cqe.res;
+      perror("io_uring recvmsg failed");
+      exit(EXIT_FAILURE);
+    }
+  } else if (cqe.flags & IORING_CQE_F_BUFFER) {
+    auto bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    const uint8_t *buffer = _uring->buffer(bid);
+    struct io_uring_recvmsg_out out{};
+    std::memcpy(&out, buffer, sizeof(out));
+    struct sockaddr_in source{};
+    std::memcpy(&source, buffer + sizeof(out), std::min<size_t>(out.namelen, sizeof(source)));
+    size_t offset = sizeof(out) + _uring_recv_msg.msg_namelen + _uring_recv_msg.msg_controllen;
+    size_t len = std::min<size_t>(out.payloadlen, _uring->buffer_size() - offset);
+    bool truncated = (out.flags & MSG_TRUNC) || len < out.payloadlen;
+
+    auto *handler = static_cast<ReadEventHandler *>(event_data->handler_obj);
+    handler->handle_datagram(buffer + offset, len, truncated, source);
+    if (std::find(_uring_batch_handlers.begin(), _uring_batch_handlers.end(), handler) ==
+        _uring_batch_handlers.end()) {
+      _uring_batch_handlers.push_back(handler);
+    }
+    _uring->recycle_buffer(bid);
+  }
+
+  // The kernel ends a multishot receive when it runs out of buffers, the
+  // recycled ones are published before the new one is submitted.
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    uring_arm_recv(event_data);
+  }
+}
+
+// The submission queue only fills up if fds are added faster than a single
+// io_uring_enter() drains it.
+struct io_uring_sqe *EventLoop::uring_sqe() {
+  struct io_uring_sqe *sqe = _uring->get_sqe();
+  if (sqe == nullptr) {
+    std::cerr << "io_uring submission queue full" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return sqe;
+}
+
+void EventLoop::uring_arm_recv(EventData *event_data) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = event_data->fd;
+  sqe->addr = reinterpret_cast<uint64_t>(&_uring_recv_msg);
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = IO_URING_BUFFER_GROUP;
+  sqe->user_data = reinterpret_cast<uint64_t>(event_data);
+}
+
+void EventLoop::uring_arm_poll(EventData *event_data) {
+  struct io_uring_sqe *sqe = uring_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = event_data->fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = reinterpret_cast<uint64_t>(event_data);
+}
+
 void EventLoop::stop() {
-  _running = false;
+  {
+    std::lock_guard<std::mutex> lock(_idle_mutex);
+    _running = false;
+  }
+  _idle_cv.notify_all();
 
   // Write to wakeup file descriptor to unblock epoll_wait
   uint64_t u = 1;
@@ -118,3 +339,11 @@ void EventLoop::stop() {
     exit(EXIT_FAILURE);
   }
 }
+
+EventLoopMode EventLoop::mode() const {
+  return _mode;
+}
+
+EventLoopStats EventLoop::stats() const {
+  return {_waits.load(std::memory_order_relaxed), _rearms.load(std::memory_order_relaxed)};
+}
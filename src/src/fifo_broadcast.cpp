@@ -0,0 +1,372 @@
+#include <algorithm>
+#include <iostream>
+#include "fifo_broadcast.hpp"
+#include "payload_codec.hpp"
+
+static size_t max_host_id(const std::vector<Parser::Host>& hosts) {
+  size_t max_id = 0;
+  for (const auto& host : hosts) {
+    max_id = std::max<size_t>(max_id, host.id);
+  }
+  return max_id;
+}
+
+FifoBroadcast::FifoBroadcast(uint64_t pid, const std::vector<Parser::Host>& hosts, uint32_t n_messages,
+                             PerfectLink &pl, LogWriter &log)
+        : _pid(pid), _n_messages(n_messages), _n_processes(hosts.size()),
+          _majority(hosts.size() / 2 + 1), _stride(max_host_id(hosts) + 1), _pl(pl), _log(log) {
+  _origins.resize(_stride);
+  for (const auto& host : hosts) {
+    _origins[host.id].pending.resize(PENDING_WINDOW);
+  }
+  _held.assign(_stride * _stride, 1);
+  _counted.assign(_stride * _stride, 1);
+  _relayed.assign(_stride * _stride, 1);
+  _next_origin.assign(_stride, 0);
+  _idle_at.assign(_stride, 0);
+  _vectors.resize(_stride);
+}
+
+FifoBroadcast::Pending& FifoBroadcast::pending(Origin& origin, uint32_t id) {
+  return origin.pending[id % PENDING_WINDOW];
+}
+
+// Refuses relays that reach past the pending window. Malformed ones are
+// dropped but taken, a retransmission would not fix them.
+bool FifoBroadcast::on_relay(uint64_t peer, const PacketView& pkt) {
+  uint32_t origin_id;
+  size_t offset = get_varint(pkt.data(), pkt.data_size(), origin_id);
+  if (offset == 0 || origin_id >= _origins.size() || _origins[origin_id].pending.empty()) {
+    return true;
+  }
+  const uint8_t *data = pkt.data() + offset;
+  size_t size = pkt.data_size() - offset;
+  uint64_t end = 0;
+  if (!decode_messages(data, size, pkt.flags(), [&end](uint32_t first, uint32_t count) {
+        end = std::max<uint64_t>(end, static_cast<uint64_t>(first) + count);
+      })) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  Origin& origin = _origins[origin_id];
+  if (end > static_cast<uint64_t>(origin.next_delivery) + PENDING_WINDOW) {
+    _refused.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  decode_messages(data, size, pkt.flags(), [this, &origin](uint32_t first, uint32_t count) {
+    for (uint32_t id = std::max(first, origin.next_delivery); id < first + count; id++) {
+      pending(origin, id).have = true;
+    }
+  });
+  hold(origin_id, origin, peer, static_cast<uint32_t>(end));
+  advance(origin);
+  deliver(origin_id, origin);
+  return true;
+}
+
+// Pairs of varint origin id and varint end of the prefix held.
+void FifoBroadcast::on_ack_vector(uint64_t peer, const PacketView& pkt) {
+  const uint8_t *data = pkt.data();
+  size_t size = pkt.data_size();
+  size_t offset = 0;
+  std::lock_guard<std::mutex> lock(_mutex);
+  while (offset < size) {
+    uint32_t origin_id;
+    uint32_t end;
+    size_t n = get_varint(data + offset, size - offset, origin_id);
+    if (n == 0) {
+      return;
+    }
+    offset += n;
+    n = get_varint(data + offset, size - offset, end);
+    if (n == 0) {
+      return;
+    }
+    offset += n;
+    if (origin_id >= _origins.size() || _origins[origin_id].pending.empty()) {
+      continue;
+    }
+    Origin& origin = _origins[origin_id];
+    hold(origin_id, origin, peer, end);
+    deliver(origin_id, origin);
+  }
+}
+
+// Records that peer holds every message of the origin below end.
+void FifoBroadcast::hold(uint64_t origin_id, Origin& origin, uint64_t peer, uint32_t end) {
+  uint32_t& held = _held[origin_id * _stride + peer];
+  if (end <= held) {
+    return;
+  }
+  held = end;
+  count_holders(origin_id, origin, peer);
+}
+
+// Counts peer as a holder of the messages in the pending window it holds and
+// was not counted for yet.
+void FifoBroadcast::count_holders(uint64_t origin_id, Origin& origin, uint64_t peer) {
+  size_t index = origin_id * _stride + peer;
+  auto limit = static_cast<uint32_t>(std::min<uint64_t>(
+      _held[index], static_cast<uint64_t>(origin.next_delivery) + PENDING_WINDOW));
+  uint32_t& counted = _counted[index];
+  for (uint32_t id = std::max(counted, origin.next_delivery); id < limit; id++) {
+    pending(origin, id).holders++;
+  }
+  counted = std::max(counted, limit);
+}
+
+// Grows the origin's contiguous prefix over the messages now held, which this
+// process holds from then on. Wakes the sender to relay them.
+void FifoBroadcast::advance(Origin& origin) {
+  uint32_t start = origin.contiguous;
+  uint64_t limit = static_cast<uint64_t>(origin.next_delivery) + PENDING_WINDOW;
+  while (origin.contiguous < limit && pending(origin, origin.contiguous).have) {
+    pending(origin, origin.contiguous).holders++;
+    origin.contiguous++;
+  }
+  if (origin.contiguous != start) {
+    _progress++;
+    _relay_epoch++;
+    _pl.send_signal().raise();
+  }
+}
+
+// Delivers the origin's messages held by a majority, in order.
+void FifoBroadcast::deliver(uint64_t origin_id, Origin& origin) {
+  uint32_t first = origin.next_delivery;
+  while (origin.next_delivery < origin.contiguous) {
+    Pending& entry = pending(origin, origin.next_delivery);
+    if (entry.holders < _majority) {
+      break;
+    }
+    entry = Pending{};
+    origin.next_delivery++;
+  }
+  uint32_t count = origin.next_delivery - first;
+  if (count == 0) {
+    return;
+  }
+  // The window moved on, peers may hold some of the messages entering it.
+  for (uint64_t peer = 0; peer < _stride; peer++) {
+    if (peer != _pid) {
+      count_holders(origin_id, origin, peer);
+    }
+  }
+  order_lines();
+  _log.append_lines('d', origin_id, first, count);
+  uint64_t delivered = _n_delivered.fetch_add(count) + count;
+  if (delivered == static_cast<uint64_t>(_n_messages) * _n_processes) {
+    std::cerr << "Process " << _pid << " delivered all messages!" << std::endl;
+  }
+  if (origin_id == _pid) {
+    // Room for more broadcasts.
+    _pl.send_signal().raise();
+  }
+}
+
+// Lines are logged under _mutex, by whichever thread holds it, and each
+// thread buffers its own. Handing the previous thread's lines to the writer
+// when another one takes over keeps the file in the order they were logged.
+void FifoBroadcast::order_lines() {
+  std::thread::id self = std::this_thread::get_id();
+  if (_last_logger != self) {
+    if (_last_logger != std::thread::id{}) {
+      _log.sync(_last_logger);
+    }
+    _last_logger = self;
+  }
+}
+
+// Broadcasts own messages up to BROADCAST_WINDOW past the oldest one not
+// delivered. Must hold _mutex.
+void FifoBroadcast::broadcast() {
+  Origin& own = _origins[_pid];
+  auto end = static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(_n_messages) + 1,
+                                                      static_cast<uint64_t>(own.next_delivery) + BROADCAST_WINDOW));
+  if (_next_broadcast >= end) {
+    return;
+  }
+  order_lines();
+  _log.append_lines('b', _next_broadcast, end - _next_broadcast);
+  for (uint32_t id = _next_broadcast; id < end; id++) {
+    pending(own, id).have = true;
+  }
+  _next_broadcast = end;
+  advance(own);
+  deliver(_pid, own);
+}
+
+// Messages of other origins held since the previous tick become stable and
+// may be relayed. Returns true while some are not stable yet. Must hold
+// _mutex.
+bool FifoBroadcast::tick(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::duration delay) {
+  bool unstable = false;
+  for (size_t origin_id = 0; origin_id < _origins.size(); origin_id++) {
+    Origin& origin = _origins[origin_id];
+    if (origin.pending.empty() || origin_id == _pid) {
+      continue;
+    }
+    if (origin.stable != origin.snapshot) {
+      origin.stable = origin.snapshot;
+      _relay_epoch++;
+    }
+    origin.snapshot = origin.contiguous;
+    unstable = unstable || origin.stable != origin.contiguous;
+  }
+  _next_tick = now + delay;
+  return unstable;
+}
+
+// Up to MESSAGES_PER_PACKET consecutive messages of one origin the peer is
+// not known to hold, prefixed with the origin id. Origins take turns.
+size_t FifoBroadcast::next_relay(uint64_t peer, WireFormat format, uint8_t *data, uint8_t& flags) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_idle_at[peer] == _relay_epoch) {
+    return 0;
+  }
+  size_t n_origins = _origins.size();
+  for (size_t i = 0; i < n_origins; i++) {
+    size_t origin_id = (_next_origin[peer] + i) % n_origins;
+    const Origin& origin = _origins[origin_id];
+    uint32_t end = origin_id == _pid ? origin.contiguous : std::min(origin.contiguous, origin.stable);
+    uint32_t& next = _relayed[peer * _stride + origin_id];
+    next = std::max(next, _held[origin_id * _stride + peer]);
+    if (next >= end) {
+      continue;
+    }
+    uint32_t count = std::min(MESSAGES_PER_PACKET, end - next);
+    uint32_t ids[MESSAGES_PER_PACKET];
+    for (uint32_t j = 0; j < count; j++) {
+      ids[j] = next + j;
+    }
+    size_t size = put_varint(data, static_cast<uint32_t>(origin_id));
+    size += encode_messages(ids, count, format, data + size, flags);
+    next += count;
+    _next_origin[peer] = origin_id + 1;
+    if (origin_id != _pid) {
+      _relays.fetch_add(count, std::memory_order_relaxed);
+    }
+    return size;
+  }
+  _idle_at[peer] = _relay_epoch;
+  return 0;
+}
+
+// Every origin with messages held, as pairs of varint origin id and varint
+// end of the prefix held. Changed vectors ride along whenever they can.
+size_t FifoBroadcast::ack_vector(uint64_t peer, uint8_t *data, size_t capacity, bool standalone) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  PeerVector& vector = _vectors[peer];
+  bool changed = vector.sent_at_progress != _progress;
+  auto now = std::chrono::steady_clock::now();
+  if (standalone ? now < vector.due : !changed) {
+    return 0;
+  }
+  size_t size = 0;
+  for (size_t origin_id = 0; origin_id < _origins.size(); origin_id++) {
+    const Origin& origin = _origins[origin_id];
+    if (origin.pending.empty() || origin.contiguous == 1) {
+      continue;
+    }
+    if (size + varint_size(static_cast<uint32_t>(origin_id)) + varint_size(origin.contiguous) > capacity) {
+      return 0;
+    }
+    size += put_varint(data + size, static_cast<uint32_t>(origin_id));
+    size += put_varint(data + size, origin.contiguous);
+  }
+  if (size == 0) {
+    return 0;
+  }
+  vector.interval = changed ? ACK_VECTOR_INTERVAL : std::min(2 * vector.interval, MAX_ACK_VECTOR_INTERVAL);
+  vector.due = now + vector.interval;
+  vector.sent_at_progress = _progress;
+  _vectors_sent.fetch_add(1, std::memory_order_relaxed);
+  if (standalone) {
+    _vectors_alone.fetch_add(1, std::memory_order_relaxed);
+  }
+  return size;
+}
+
+// Must hold _mutex.
+std::chrono::steady_clock::time_point FifoBroadcast::next_vector_due() const {
+  auto due = std::chrono::steady_clock::time_point::max();
+  for (size_t peer = 0; peer < _vectors.size(); peer++) {
+    if (peer != _pid && !_origins[peer].pending.empty()) {
+      due = std::min(due, _vectors[peer].due);
+    }
+  }
+  return due;
+}
+
+void FifoBroadcast::run() {
+  const int initial_interval_ms = 1;
+  const int max_interval_ms = 50;
+  int timeout_interval_ms = initial_interval_ms;
+
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    auto next_deadline = now + std::chrono::seconds(1);
+    // Links are locked before _mutex, never while holding it.
+    std::chrono::steady_clock::duration relay_delay{};
+    if (now >= _next_tick) {
+      relay_delay = std::clamp<std::chrono::steady_clock::duration>(
+          2 * _pl.send_stats().rto, MIN_RELAY_DELAY, MAX_RELAY_DELAY);
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_stop) {
+        break;
+      }
+      broadcast();
+      if (now >= _next_tick) {
+        _unstable = tick(now, relay_delay);
+      }
+      if (_unstable) {
+        next_deadline = std::min(next_deadline, _next_tick);
+      }
+      next_deadline = std::min(next_deadline, next_vector_due());
+    }
+
+    if (!_pl.send_round(_log, next_deadline)) {
+      // The socket buffer is full, give the receivers time to drain it.
+      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_interval_ms));
+      timeout_interval_ms = std::min(2 * timeout_interval_ms, max_interval_ms);
+      continue;
+    }
+    timeout_interval_ms = initial_interval_ms;
+    // Sleep until a timer expires, an ACK makes room in a window or there is
+    // something new to send.
+    _pl.send_signal().wait_until(next_deadline);
+  }
+
+  print_stats();
+}
+
+void FifoBroadcast::print_stats() {
+  SendStats stats = _pl.send_stats();
+  std::cerr << "Broadcast stopped: retransmitted " << stats.retransmissions << " of "
+            << stats.transmissions << " transmissions, relayed " << _relays.load()
+            << " messages, " << _refused.load() << " relays refused" << std::endl;
+  uint64_t datagrams = stats.datagrams + stats.control_datagrams;
+  uint64_t delivered = _n_delivered.load();
+  std::cerr << "Sent " << datagrams << " datagrams (" << stats.datagrams << " with DATA), "
+            << _vectors_sent.load() << " ack vectors (" << _vectors_alone.load() << " on their own)";
+  if (delivered > 0) {
+    std::cerr << ", " << static_cast<double>(datagrams) / static_cast<double>(delivered)
+              << " datagrams per delivered message";
+  }
+  std::cerr << std::endl;
+}
+
+void FifoBroadcast::stop() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _pl.send_signal().raise();
+}
+
+uint64_t FifoBroadcast::delivered() const {
+  return _n_delivered.load();
+}
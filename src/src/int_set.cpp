@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <cstring>
+#include "int_set.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Fastest word operations to pick on x86-64: 0 scalar, 1 SSE2 and POPCNT,
+// 2 AVX2. Lower it to run the fallbacks on a CPU that has more.
+#ifndef INT_SET_MAX_WORD_OPS
+#define INT_SET_MAX_WORD_OPS 2
+#endif
+
+constexpr static uint64_t WORD_BITS = 64;
+// Words of the uint32_t value range.
+constexpr static uint64_t MAX_WORDS = (uint64_t{UINT32_MAX} + 1) / WORD_BITS;
+
+// Word operations over bitmaps, picked once for the CPU.
+struct WordOps {
+    // dst[i] |= src[i].
+    void (*merge)(uint64_t *dst, const uint64_t *src, size_t n);
+    // dst[i] &= ~src[i].
+    void (*remove)(uint64_t *dst, const uint64_t *src, size_t n);
+    // Whether every a[i] & ~b[i] is 0.
+    bool (*subset)(const uint64_t *a, const uint64_t *b, size_t n);
+    size_t (*count)(const uint64_t *words, size_t n);
+};
+
+static void merge_scalar(uint64_t *dst, const uint64_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] |= src[i];
+  }
+}
+
+static void remove_scalar(uint64_t *dst, const uint64_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] &= ~src[i];
+  }
+}
+
+static bool subset_scalar(const uint64_t *a, const uint64_t *b, size_t n) {
+  uint64_t extra = 0;
+  for (size_t i = 0; i < n; i++) {
+    extra |= a[i] & ~b[i];
+  }
+  return extra == 0;
+}
+
+static size_t count_scalar(const uint64_t *words, size_t n) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    count += static_cast<size_t>(__builtin_popcountll(words[i]));
+  }
+  return count;
+}
+
+#if defined(__x86_64__)
+// SSE2 comes with every x86-64 CPU, AVX2 and POPCNT are checked at run time.
+static void merge_sse2(uint64_t *dst, const uint64_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(a, b));
+  }
+  merge_scalar(dst + i, src + i, n - i);
+}
+
+static void remove_sse2(uint64_t *dst, const uint64_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_andnot_si128(b, a));
+  }
+  remove_scalar(dst + i, src + i, n - i);
+}
+
+static bool subset_sse2(const uint64_t *a, const uint64_t *b, size_t n) {
+  __m128i extra = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    extra = _mm_or_si128(extra, _mm_andnot_si128(y, x));
+  }
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(extra, _mm_setzero_si128())) == 0xffff &&
+         subset_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void merge_avx2(uint64_t *dst, const uint64_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(a, b));
+  }
+  merge_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void remove_avx2(uint64_t *dst, const uint64_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_andnot_si256(b, a));
+  }
+  remove_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static bool subset_avx2(const uint64_t *a, const uint64_t *b, size_t n) {
+  __m256i extra = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    extra = _mm256_or_si256(extra, _mm256_andnot_si256(y, x));
+  }
+  return _mm256_testz_si256(extra, extra) != 0 && subset_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("popcnt")))
+static size_t count_popcnt(const uint64_t *words, size_t n) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    count += static_cast<size_t>(__builtin_popcountll(words[i]));
+  }
+  return count;
+}
+#endif
+
+static WordOps select_word_ops() {
+  WordOps ops{merge_scalar, remove_scalar, subset_scalar, count_scalar};
+#if defined(__x86_64__)
+  if (INT_SET_MAX_WORD_OPS >= 1) {
+    ops.merge = merge_sse2;
+    ops.remove = remove_sse2;
+    ops.subset = subset_sse2;
+  }
+  if (INT_SET_MAX_WORD_OPS >= 2 && __builtin_cpu_supports("avx2")) {
+    ops.merge = merge_avx2;
+    ops.remove = remove_avx2;
+    ops.subset = subset_avx2;
+  }
+  if (INT_SET_MAX_WORD_OPS >= 1 && __builtin_cpu_supports("popcnt")) {
+    ops.count = count_popcnt;
+  }
+#endif
+  return ops;
+}
+
+static const WordOps& word_ops() {
+  static const WordOps ops = select_word_ops();
+  return ops;
+}
+
+IntSet::IntSet(std::vector<uint32_t> values) : _values(std::move(values)), _size(_values.size()) {
+  if (_size > 0) {
+    uint64_t first_word = _values.front() / WORD_BITS;
+    uint64_t end_word = _values.back() / WORD_BITS + 1;
+    if (bitmap_pays(end_word - first_word, _size)) {
+      to_bitmap(first_word, end_word);
+    }
+  }
+}
+
+uint64_t IntSet::word_begin() const {
+  if (_dense) {
+    return _base / WORD_BITS;
+  }
+  return _values.empty() ? 0 : _values.front() / WORD_BITS;
+}
+
+uint64_t IntSet::word_end() const {
+  if (_dense) {
+    return _base / WORD_BITS + _words.size();
+  }
+  return _values.empty() ? 0 : _values.back() / WORD_BITS + 1;
+}
+
+bool IntSet::bitmap_pays(uint64_t n_words, size_t size) const {
+  return n_words * sizeof(uint64_t) <= size * sizeof(uint32_t);
+}
+
+// Turns the set into a bitmap over the given words, which must cover it.
+void IntSet::to_bitmap(uint64_t first_word, uint64_t end_word) {
+  std::vector<uint64_t> words(end_word - first_word, 0);
+  auto base = static_cast<uint32_t>(first_word * WORD_BITS);
+  if (_dense) {
+    std::copy(_words.begin(), _words.end(), words.begin() + static_cast<std::ptrdiff_t>(word_begin() - first_word));
+  } else {
+    for (uint32_t value : _values) {
+      uint32_t offset = value - base;
+      words[offset / WORD_BITS] |= uint64_t{1} << (offset % WORD_BITS);
+    }
+    _values.clear();
+  }
+  _words = std::move(words);
+  _base = base;
+  _dense = true;
+}
+
+// Drops the zero words at both ends.
+void IntSet::trim() {
+  auto first = std::find_if(_words.begin(), _words.end(), [](uint64_t word) { return word != 0; });
+  if (first == _words.end()) {
+    _words.clear();
+    _base = 0;
+    _dense = false;
+    return;
+  }
+  auto last = std::find_if(_words.rbegin(), _words.rend(), [](uint64_t word) { return word != 0; }).base();
+  _base += static_cast<uint32_t>(static_cast<uint64_t>(first - _words.begin()) * WORD_BITS);
+  _words.erase(last, _words.end());
+  _words.erase(_words.begin(), first);
+}
+
+size_t IntSet::size() const {
+  return _size;
+}
+
+bool IntSet::empty() const {
+  return _size == 0;
+}
+
+bool IntSet::dense() const {
+  return _dense;
+}
+
+bool IntSet::contains(uint32_t value) const {
+  if (!_dense) {
+    return std::binary_search(_values.begin(), _values.end(), value);
+  }
+  if (value < _base) {
+    return false;
+  }
+  uint32_t offset = value - _base;
+  return offset / WORD_BITS < _words.size() && (_words[offset / WORD_BITS] >> (offset % WORD_BITS) & 1) != 0;
+}
+
+bool IntSet::includes(const IntSet& other) const {
+  if (other._size == 0) {
+    return true;
+  }
+  if (other._size > _size || other.word_begin() < word_begin() || other.word_end() > word_end()) {
+    return false;
+  }
+  if (!_dense && !other._dense) {
+    return std::includes(_values.begin(), _values.end(), other._values.begin(), other._values.end());
+  }
+  if (_dense && other._dense) {
+    return word_ops().subset(other._words.data(), _words.data() + (other.word_begin() - word_begin()),
+                             other._words.size());
+  }
+  if (_dense) {
+    return std::all_of(other._values.begin(), other._values.end(),
+                       [this](uint32_t value) { return contains(value); });
+  }
+  // Walk both in order, other's values are a bitmap.
+  bool included = true;
+  auto it = _values.begin();
+  other.for_each([&](uint32_t value) {
+    if (included) {
+      it = std::lower_bound(it, _values.end(), value);
+      included = it != _values.end() && *it == value;
+    }
+  });
+  return included;
+}
+
+// Merges other into the set as a bitmap covering both. Returns whether the
+// set grew.
+bool IntSet::merge_bitmap(const IntSet& other, std::vector<uint32_t> *added) {
+  uint64_t first_word = std::min(word_begin(), other.word_begin());
+  uint64_t end_word = std::max(word_end(), other.word_end());
+  if (!_dense || first_word < word_begin() || end_word > word_end()) {
+    to_bitmap(first_word, end_word);
+  }
+  size_t old_size = _size;
+  if (other._dense) {
+    uint64_t *words = _words.data() + (other.word_begin() - first_word);
+    if (added != nullptr) {
+      for (size_t w = 0; w < other._words.size(); w++) {
+        uint64_t bits = other._words[w] & ~words[w];
+        while (bits != 0) {
+          auto bit = static_cast<uint32_t>(__builtin_ctzll(bits));
+          bits &= bits - 1;
+          added->push_back(other._base + static_cast<uint32_t>(w * WORD_BITS) + bit);
+        }
+      }
+    }
+    word_ops().merge(words, other._words.data(), other._words.size());
+    _size = word_ops().count(_words.data(), _words.size());
+  } else {
+    for (uint32_t value : other._values) {
+      uint32_t offset = value - _base;
+      uint64_t bit = uint64_t{1} << (offset % WORD_BITS);
+      uint64_t& word = _words[offset / WORD_BITS];
+      if ((word & bit) == 0) {
+        word |= bit;
+        _size++;
+        if (added != nullptr) {
+          added->push_back(value);
+        }
+      }
+    }
+  }
+  return _size > old_size;
+}
+
+bool IntSet::merge(const IntSet& other, std::vector<uint32_t> *added) {
+  if (other._size == 0) {
+    return false;
+  }
+  if (_size == 0) {
+    *this = other;
+    if (added != nullptr) {
+      for_each([added](uint32_t value) {
+        added->push_back(value);
+      });
+    }
+    return true;
+  }
+  uint64_t n_words = std::max(word_end(), other.word_end()) - std::min(word_begin(), other.word_begin());
+  // The union has at least half as many values, a bitmap is at most twice
+  // as sparse as it pays for. A union with far away values is made a
+  // vector again.
+  if ((_dense || other._dense) && bitmap_pays(n_words, _size + other._size)) {
+    return merge_bitmap(other, added);
+  }
+
+  std::vector<uint32_t> dense_mine;
+  std::vector<uint32_t> dense_theirs;
+  if (_dense) {
+    dense_mine = values();
+  }
+  if (other._dense) {
+    dense_theirs = other.values();
+  }
+  const std::vector<uint32_t>& mine = _dense ? dense_mine : _values;
+  const std::vector<uint32_t>& theirs = other._dense ? dense_theirs : other._values;
+  std::vector<uint32_t> merged;
+  merged.reserve(_size + other._size);
+  auto a = mine.begin();
+  auto b = theirs.begin();
+  while (b != theirs.end()) {
+    if (a != mine.end() && *a <= *b) {
+      b += *a == *b;
+      merged.push_back(*a++);
+    } else {
+      if (added != nullptr) {
+        added->push_back(*b);
+      }
+      merged.push_back(*b++);
+    }
+  }
+  merged.insert(merged.end(), a, mine.end());
+  if (merged.size() == _size) {
+    return false;
+  }
+  *this = IntSet(std::move(merged));
+  return true;
+}
+
+IntSet IntSet::difference(const IntSet& other) const {
+  IntSet result;
+  if (_dense && other._dense) {
+    result = *this;
+    uint64_t first_word = std::max(word_begin(), other.word_begin());
+    uint64_t end_word = std::min(word_end(), other.word_end());
+    if (first_word < end_word) {
+      word_ops().remove(result._words.data() + (first_word - word_begin()),
+                        other._words.data() + (first_word - other.word_begin()), end_word - first_word);
+      result.trim();
+      result._size = word_ops().count(result._words.data(), result._words.size());
+    }
+    return result;
+  }
+  std::vector<uint32_t> values;
+  if (other._dense || other._size > 16 * _size) {
+    for_each([&other, &values](uint32_t value) {
+      if (!other.contains(value)) {
+        values.push_back(value);
+      }
+    });
+  } else {
+    // Walk both in order.
+    auto it = other._values.begin();
+    for_each([&other, &values, &it](uint32_t value) {
+      while (it != other._values.end() && *it < value) {
+        ++it;
+      }
+      if (it == other._values.end() || *it != value) {
+        values.push_back(value);
+      }
+    });
+  }
+  return IntSet(std::move(values));
+}
+
+std::vector<uint32_t> IntSet::values() const {
+  if (!_dense) {
+    return _values;
+  }
+  std::vector<uint32_t> values;
+  values.reserve(_size);
+  for_each([&values](uint32_t value) {
+    values.push_back(value);
+  });
+  return values;
+}
+
+void IntSet::encode_chunks(size_t chunk_size, std::vector<uint8_t>& out, std::vector<size_t>& ends) const {
+  std::vector<uint32_t> dense_values;
+  if (_dense) {
+    dense_values = this->values();
+  }
+  const std::vector<uint32_t>& values = _dense ? dense_values : _values;
+  size_t delta_size = 0;
+  for (size_t i = 0; i < values.size(); i++) {
+    delta_size += varint_size(i == 0 ? values[i] : values[i] - values[i - 1] - 1);
+  }
+
+  if (_dense && _words.size() * sizeof(uint64_t) < delta_size) {
+    size_t words_per_chunk = (chunk_size - 1 - 2 * MAX_VARINT32_SIZE) / sizeof(uint64_t);
+    for (size_t first = 0; first < _words.size(); first += words_per_chunk) {
+      auto n_words = static_cast<uint32_t>(std::min(words_per_chunk, _words.size() - first));
+      size_t offset = out.size();
+      out.resize(offset + 1 + 2 * MAX_VARINT32_SIZE + n_words * sizeof(uint64_t));
+      out[offset++] = SET_CHUNK_BITMAP;
+      offset += put_varint(out.data() + offset, static_cast<uint32_t>(word_begin() + first));
+      offset += put_varint(out.data() + offset, n_words);
+      std::memcpy(out.data() + offset, _words.data() + first, n_words * sizeof(uint64_t));
+      out.resize(offset + n_words * sizeof(uint64_t));
+      ends.push_back(out.size());
+    }
+    return;
+  }
+
+  size_t first = 0;
+  do {
+    // The count takes no more than the count of every value left.
+    size_t budget = chunk_size - 1 - varint_size(static_cast<uint32_t>(values.size() - first));
+    size_t end = first;
+    size_t bytes = 0;
+    while (end < values.size()) {
+      size_t n = varint_size(end == first ? values[end] : values[end] - values[end - 1] - 1);
+      if (bytes + n > budget) {
+        break;
+      }
+      bytes += n;
+      end++;
+    }
+    size_t offset = out.size();
+    out.resize(offset + 1 + MAX_VARINT32_SIZE + bytes);
+    out[offset++] = SET_CHUNK_DELTA;
+    offset += put_varint(out.data() + offset, static_cast<uint32_t>(end - first));
+    for (size_t i = first; i < end; i++) {
+      offset += put_varint(out.data() + offset, i == first ? values[i] : values[i] - values[i - 1] - 1);
+    }
+    out.resize(offset);
+    ends.push_back(out.size());
+    first = end;
+  } while (first < values.size());
+}
+
+size_t IntSet::decode_chunk(const uint8_t *data, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  size_t offset = 1;
+  IntSet chunk;
+  switch (data[0]) {
+    case SET_CHUNK_DELTA:
+    {
+      uint32_t count;
+      size_t n = get_varint(data + offset, size - offset, count);
+      if (n == 0 || count > size - offset - n) {
+        return 0;
+      }
+      offset += n;
+      std::vector<uint32_t> values;
+      values.reserve(count);
+      uint64_t value = 0;
+      for (uint32_t i = 0; i < count; i++) {
+        uint32_t gap;
+        n = get_varint(data + offset, size - offset, gap);
+        if (n == 0) {
+          return 0;
+        }
+        offset += n;
+        value = i == 0 ? gap : value + gap + 1;
+        if (value > UINT32_MAX) {
+          return 0;
+        }
+        values.push_back(static_cast<uint32_t>(value));
+      }
+      chunk = IntSet(std::move(values));
+      break;
+    }
+    case SET_CHUNK_BITMAP:
+    {
+      uint32_t first_word;
+      uint32_t n_words;
+      size_t n = get_varint(data + offset, size - offset, first_word);
+      if (n == 0) {
+        return 0;
+      }
+      offset += n;
+      n = get_varint(data + offset, size - offset, n_words);
+      if (n == 0 || n_words == 0 || n_words > (size - offset - n) / sizeof(uint64_t) ||
+          uint64_t{first_word} + n_words > MAX_WORDS) {
+        return 0;
+      }
+      offset += n;
+      chunk._words.resize(n_words);
+      std::memcpy(chunk._words.data(), data + offset, n_words * sizeof(uint64_t));
+      offset += n_words * sizeof(uint64_t);
+      chunk._base = static_cast<uint32_t>(uint64_t{first_word} * WORD_BITS);
+      chunk._dense = true;
+      chunk.trim();
+      chunk._size = word_ops().count(chunk._words.data(), chunk._words.size());
+      break;
+    }
+    default:
+      return 0;
+  }
+  merge(chunk);
+  return offset;
+}
@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "io_uring.hpp"
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params *params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int sys_io_uring_register(int fd, uint32_t opcode, void *arg, uint32_t nr_args) {
+  return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+static uint32_t *ring_field(void *ring, uint32_t offset) {
+  return reinterpret_cast<uint32_t *>(static_cast<uint8_t *>(ring) + offset);
+}
+
+std::unique_ptr<IoUring> IoUring::create(uint32_t entries, uint32_t cq_entries,
+                                         uint16_t buf_count, size_t buf_size) {
+  std::unique_ptr<IoUring> ring(new IoUring());
+  if (!ring->setup(entries, cq_entries) || !ring->register_buffers(buf_count, buf_size)) {
+    return nullptr;
+  }
+  return ring;
+}
+
+bool IoUring::setup(uint32_t entries, uint32_t cq_entries) {
+  struct io_uring_params params{};
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = cq_entries;
+  _ring_fd = sys_io_uring_setup(entries, &params);
+  if (_ring_fd < 0) {
+    perror("io_uring_setup failed");
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+    std::cerr << "io_uring lacks required features" << std::endl;
+    return false;
+  }
+  // Multishot recvmsg cannot be probed for and would only fail on its first
+  // completion. It shipped in the same release as IORING_OP_SEND_ZC.
+  alignas(struct io_uring_probe) uint8_t probe_buf[sizeof(struct io_uring_probe) +
+                                                   IORING_OP_LAST * sizeof(struct io_uring_probe_op)]{};
+  auto *probe = reinterpret_cast<struct io_uring_probe *>(probe_buf);
+  if (sys_io_uring_register(_ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0 ||
+      probe->last_op < IORING_OP_SEND_ZC ||
+      !(probe->ops[IORING_OP_RECVMSG].flags & IO_URING_OP_SUPPORTED)) {
+    std::cerr << "io_uring does not support multishot recvmsg" << std::endl;
+    return false;
+  }
+
+  _rings_size = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                         params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  _rings = map_ring(_ring_fd, _rings_size, IORING_OFF_SQ_RING);
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = static_cast<struct io_uring_sqe *>(map_ring(_ring_fd, _sqes_size, IORING_OFF_SQES));
+  if (_rings == nullptr || _sqes == nullptr) {
+    perror("io_uring mmap failed");
+    return false;
+  }
+
+  _sq_head = ring_field(_rings, params.sq_off.head);
+  _sq_tail = ring_field(_rings, params.sq_off.tail);
+  _sq_array = ring_field(_rings, params.sq_off.array);
+  _sq_mask = *ring_field(_rings, params.sq_off.ring_mask);
+  _sq_entries = params.sq_entries;
+  _sq_local_tail = *_sq_tail;
+  _cq_head = ring_field(_rings, params.cq_off.head);
+  _cq_tail = ring_field(_rings, params.cq_off.tail);
+  _cq_mask = *ring_field(_rings, params.cq_off.ring_mask);
+  _cqes = reinterpret_cast<struct io_uring_cqe *>(static_cast<uint8_t *>(_rings) + params.cq_off.cqes);
+  return true;
+}
+
+// Registers buf_count buffers of buf_size bytes as IO_URING_BUFFER_GROUP.
+// buf_count must be a power of two.
+bool IoUring::register_buffers(uint16_t count, size_t size) {
+  _buf_ring_size = count * sizeof(struct io_uring_buf);
+  void *ring = mmap(nullptr, _buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    perror("mmap of the io_uring buffer ring failed");
+    return false;
+  }
+  _buf_ring = static_cast<struct io_uring_buf_ring *>(ring);
+
+  struct io_uring_buf_reg reg{};
+  reg.ring_addr = reinterpret_cast<uint64_t>(_buf_ring);
+  reg.ring_entries = count;
+  reg.bgid = IO_URING_BUFFER_GROUP;
+  if (sys_io_uring_register(_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    perror("io_uring buffer ring registration failed");
+    return false;
+  }
+
+  _buf_count = count;
+  _buf_size = size;
+  _buffers.resize(static_cast<size_t>(count) * size);
+  for (uint16_t bid = 0; bid < count; bid++) {
+    recycle_buffer(bid);
+  }
+  publish_buffers();
+  return true;
+}
+
+IoUring::~IoUring() {
+  if (_buf_ring != nullptr) {
+    munmap(_buf_ring, _buf_ring_size);
+  }
+  if (_sqes != nullptr) {
+    munmap(_sqes, _sqes_size);
+  }
+  if (_rings != nullptr) {
+    munmap(_rings, _rings_size);
+  }
+  if (_ring_fd >= 0) {
+    close(_ring_fd);
+  }
+}
+
+// Returns nullptr when the submission queue is full.
+struct io_uring_sqe *IoUring::get_sqe() {
+  uint32_t head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+  if (_sq_local_tail - head >= _sq_entries) {
+    return nullptr;
+  }
+  uint32_t index = _sq_local_tail & _sq_mask;
+  struct io_uring_sqe *sqe = &_sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  _sq_array[index] = index;
+  _sq_local_tail++;
+  _to_submit++;
+  return sqe;
+}
+
+// Submits everything queued by get_sqe() and waits for at least min_complete
+// completions in the same syscall. Returns -errno on failure.
+int IoUring::submit_and_wait(uint32_t min_complete) {
+  __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+  int ret = sys_io_uring_enter(_ring_fd, _to_submit, min_complete, IORING_ENTER_GETEVENTS);
+  if (ret < 0) {
+    return -errno;
+  }
+  _to_submit -= std::min(_to_submit, static_cast<uint32_t>(ret));
+  return ret;
+}
+
+uint8_t *IoUring::buffer(uint16_t bid) {
+  return _buffers.data() + static_cast<size_t>(bid) * _buf_size;
+}
+
+size_t IoUring::buffer_size() const {
+  return _buf_size;
+}
+
+// Hands a buffer back to the kernel, visible after publish_buffers().
+void IoUring::recycle_buffer(uint16_t bid) {
+  // Not _buf_ring->bufs: in C++ the empty struct the uapi header puts in
+  // front of that flexible array takes up space and shifts it.
+  struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(_buf_ring) +
+                             (_buf_tail & (_buf_count - 1U));
+  buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+  buf->len = static_cast<uint32_t>(_buf_size);
+  buf->bid = bid;
+  _buf_tail = static_cast<uint16_t>(_buf_tail + 1);
+}
+
+void IoUring::publish_buffers() {
+  __atomic_store_n(&_buf_ring->tail, _buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,507 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include "lattice_agreement.hpp"
+
+// Type byte of a message: its MessageType, and whether the set it carries
+// comes in several parts.
+constexpr static uint8_t MESSAGE_TYPE_MASK = 0x03;
+constexpr static uint8_t MESSAGE_IN_PARTS = 0x80;
+// Type byte, then varint shot, number, version, part and part count.
+constexpr static size_t MAX_MESSAGE_HEADER_SIZE = 1 + 5 * MAX_VARINT32_SIZE;
+// A part carries one chunk of the set, which fits in a packet on its own.
+constexpr static size_t MAX_CHUNK_SIZE = LATTICE_PACKET_SIZE - MAX_MESSAGE_HEADER_SIZE;
+// Sanity bound on the parts of a received set, well above what the largest
+// proposal the config allows needs.
+constexpr static uint32_t MAX_PARTS = 1 << 16;
+
+static size_t max_host_id(const std::vector<Parser::Host>& hosts) {
+  size_t max_id = 0;
+  for (const auto& host : hosts) {
+    max_id = std::max<size_t>(max_id, host.id);
+  }
+  return max_id;
+}
+
+LatticeAgreement::LatticeAgreement(uint64_t pid, const std::vector<Parser::Host>& hosts, const Config &cfg,
+                                   PerfectLink &pl, LogWriter &log)
+        : _pid(pid), _cfg(cfg), _n_shots(cfg.n_proposals()), _majority(hosts.size() / 2 + 1),
+          _stride(max_host_id(hosts) + 1), _pl(pl), _log(log) {
+  for (const auto& host : hosts) {
+    if (host.id != pid) {
+      _peers.push_back(host.id);
+    }
+  }
+  _shots.resize(MAX_ACTIVE_SHOTS);
+  _acceptors.resize(_n_shots);
+  _queues.resize(_stride);
+}
+
+LatticeAgreement::Shot& LatticeAgreement::shot(uint32_t id) {
+  return _shots[id % MAX_ACTIVE_SHOTS];
+}
+
+// Opens the shots the reorder buffer has room for. Must hold _mutex.
+void LatticeAgreement::open_shots() {
+  while (_next_shot < _n_shots && _next_shot - _next_decision < MAX_ACTIVE_SHOTS) {
+    Shot& next = shot(_next_shot);
+    next = Shot{};
+    next.id = _next_shot;
+    next.active = true;
+    next.proposal = IntSet(_cfg.proposal(_next_shot));
+    _next_shot++;
+    propose(next, IntSet{});
+  }
+}
+
+// Starts a new round of the shot: every acceptor, this process included, gets
+// the proposal with a new number. Those that answered the previous round
+// only get the values it added. Must hold _mutex.
+void LatticeAgreement::propose(Shot& shot, const IntSet& added) {
+  drop_partials(shot.id);
+  shot.number++;
+  _rounds.fetch_add(1, std::memory_order_relaxed);
+  std::shared_ptr<const EncodedSet> whole;
+  std::shared_ptr<const EncodedSet> delta;
+  for (uint64_t peer : _peers) {
+    if (peer >= shot.answered.size() || !shot.answered[peer]) {
+      if (whole == nullptr) {
+        whole = encode_set(shot.proposal);
+      }
+      send(peer, {MessageType::PROPOSAL, shot.id, shot.number, 0, 0, whole});
+    } else if (shot.refusals[peer].empty()) {
+      if (delta == nullptr) {
+        delta = encode_set(added);
+      }
+      send(peer, {MessageType::PROPOSAL, shot.id, shot.number, shot.versions[peer], 0, delta});
+    } else {
+      // What the acceptor refused with is in its version already.
+      send(peer, {MessageType::PROPOSAL, shot.id, shot.number, shot.versions[peer], 0,
+                  encode_set(added.difference(shot.refusals[peer]))});
+    }
+  }
+  shot.answered.assign(_stride, false);
+  shot.versions.assign(_stride, 0);
+  shot.refusals.assign(_stride, IntSet{});
+  shot.refused = IntSet{};
+  shot.acks = 0;
+  shot.nacks = 0;
+  // Last, the answer may start the next round or decide.
+  accept(_pid, shot.id, shot.number, 0, shot.proposal);
+}
+
+// Acceptor side: the proposal is the accepted values up to version, plus
+// values. It is acknowledged if it contains everything accepted so far in the
+// shot, and refused with the accepted values it lacks otherwise. Either way
+// its values are accepted. Must hold _mutex.
+void LatticeAgreement::accept(uint64_t peer, uint32_t shot_id, uint32_t number, uint32_t version,
+                              const IntSet& values) {
+  if (shot_id >= _n_shots || version > _acceptors[shot_id].log.size()) {
+    return;
+  }
+  Acceptor& acceptor = _acceptors[shot_id];
+  // The values accepted since version that the proposal lacks. A whole
+  // proposal is compared with the whole set, which is quicker than the log.
+  IntSet lacking;
+  if (version == 0) {
+    if (!values.includes(acceptor.accepted)) {
+      lacking = acceptor.accepted.difference(values);
+    }
+  } else if (version < acceptor.log.size()) {
+    std::vector<uint32_t> since(acceptor.log.begin() + version, acceptor.log.end());
+    std::sort(since.begin(), since.end());
+    lacking = IntSet(std::move(since)).difference(values);
+  }
+  acceptor.accepted.merge(values, &acceptor.log);
+
+  auto answered = static_cast<uint32_t>(acceptor.log.size());
+  if (peer == _pid) {
+    on_answer(peer, shot_id, number, lacking.empty(), answered, lacking);
+  } else if (lacking.empty()) {
+    send(peer, {MessageType::ACK, shot_id, number, answered, 0, nullptr});
+  } else {
+    send(peer, {MessageType::NACK, shot_id, number, answered, 0, encode_set(lacking)});
+  }
+}
+
+// Proposer side: counts the answers to the current round of an active shot,
+// each acceptor once. Must hold _mutex.
+void LatticeAgreement::on_answer(uint64_t peer, uint32_t shot_id, uint32_t number, bool ack,
+                                 uint32_t version, const IntSet& values) {
+  Shot& current = shot(shot_id);
+  if (current.id != shot_id || !current.active || current.number != number ||
+      peer >= current.answered.size() || current.answered[peer]) {
+    return;
+  }
+  current.answered[peer] = true;
+  current.versions[peer] = version;
+  if (ack) {
+    current.acks++;
+  } else {
+    current.nacks++;
+    current.refusals[peer] = values;
+    current.refused.merge(values);
+  }
+  if (current.acks >= _majority) {
+    decide(current);
+  } else if (current.nacks > 0 && current.acks + current.nacks >= _majority) {
+    // Refusals only carry values the proposal lacks.
+    IntSet added = std::move(current.refused);
+    current.proposal.merge(added);
+    propose(current, added);
+  }
+}
+
+// Erases the NACKs of the shot's current round still being put back
+// together, the round is over. Must hold _mutex.
+void LatticeAgreement::drop_partials(uint32_t shot_id) {
+  if (_partials.empty()) {
+    return;
+  }
+  for (uint64_t peer : _peers) {
+    _partials.erase(partial_key(peer, MessageType::NACK, shot_id));
+  }
+}
+
+// Logs the decisions at the head of the reorder buffer, in shot order. Must
+// hold _mutex.
+void LatticeAgreement::decide(Shot& shot) {
+  shot.active = false;
+  shot.decided = true;
+  drop_partials(shot.id);
+  uint32_t first = _next_decision;
+  while (_next_decision < _next_shot && this->shot(_next_decision).decided) {
+    Shot& head = this->shot(_next_decision);
+    order_lines();
+    std::vector<uint32_t> values = head.proposal.values();
+    _log.append_values(values.data(), values.size());
+    head = Shot{};
+    _next_decision++;
+  }
+  if (_next_decision == first) {
+    return;
+  }
+  uint64_t decided = _n_decided.fetch_add(_next_decision - first) + (_next_decision - first);
+  if (decided == _n_shots) {
+    std::cerr << "Process " << _pid << " decided all shots!" << std::endl;
+  }
+  // Room to open more shots.
+  _pl.send_signal().raise();
+}
+
+// Lines are logged under _mutex, by whichever thread holds it, and each
+// thread buffers its own. Handing the previous thread's lines to the writer
+// when another one takes over keeps the file in the order they were logged.
+void LatticeAgreement::order_lines() {
+  std::thread::id self = std::this_thread::get_id();
+  if (_last_logger != self) {
+    if (_last_logger != std::thread::id{}) {
+      _log.sync(_last_logger);
+    }
+    _last_logger = self;
+  }
+}
+
+// The sender is woken once the caller is done. Must hold _mutex.
+void LatticeAgreement::send(uint64_t peer, Outgoing message) {
+  _queues[peer].push_back(std::move(message));
+  _queued = true;
+}
+
+// A proposal superseded before any of it went out is dropped. Must hold
+// _mutex.
+bool LatticeAgreement::stale(const Outgoing& message) {
+  if (message.type != MessageType::PROPOSAL || message.part > 0) {
+    return false;
+  }
+  const Shot& current = shot(message.shot);
+  return current.id != message.shot || !current.active || current.number != message.number;
+}
+
+std::shared_ptr<const LatticeAgreement::EncodedSet> LatticeAgreement::encode_set(const IntSet& values) {
+  auto encoded = std::make_shared<EncodedSet>();
+  values.encode_chunks(MAX_CHUNK_SIZE, encoded->bytes, encoded->ends);
+  return encoded;
+}
+
+// Type byte, varint shot, number and version, varint part and part count if
+// the set comes in parts, then for a PROPOSAL or NACK the part's chunk of the set.
+// Returns 0 if the message does not fit.
+size_t LatticeAgreement::encode_message(const Outgoing& message, uint8_t *data, size_t capacity) {
+  const EncodedSet *set = message.set.get();
+  auto parts = static_cast<uint32_t>(set != nullptr ? set->ends.size() : 1);
+  size_t chunk_begin = set != nullptr && message.part > 0 ? set->ends[message.part - 1] : 0;
+  size_t chunk_size = set != nullptr ? set->ends[message.part] - chunk_begin : 0;
+
+  size_t size = 1 + varint_size(message.shot) + varint_size(message.number) + varint_size(message.version) +
+                chunk_size;
+  if (parts > 1) {
+    size += varint_size(message.part) + varint_size(parts);
+  }
+  if (size > capacity) {
+    return 0;
+  }
+
+  size_t offset = 0;
+  data[offset++] = static_cast<uint8_t>(static_cast<uint8_t>(message.type) | (parts > 1 ? MESSAGE_IN_PARTS : 0));
+  offset += put_varint(data + offset, message.shot);
+  offset += put_varint(data + offset, message.number);
+  offset += put_varint(data + offset, message.version);
+  if (parts > 1) {
+    offset += put_varint(data + offset, message.part);
+    offset += put_varint(data + offset, parts);
+  }
+  if (chunk_size > 0) {
+    std::memcpy(data + offset, set->bytes.data() + chunk_begin, chunk_size);
+    offset += chunk_size;
+  }
+  return offset;
+}
+
+// Returns the bytes consumed, 0 if the message is malformed.
+size_t LatticeAgreement::decode_message(const uint8_t *data, size_t size, Message& message) {
+  if (size == 0 || (data[0] & MESSAGE_TYPE_MASK) > static_cast<uint8_t>(MessageType::NACK)) {
+    return 0;
+  }
+  message.type = static_cast<MessageType>(data[0] & MESSAGE_TYPE_MASK);
+  bool in_parts = (data[0] & MESSAGE_IN_PARTS) != 0;
+  size_t offset = 1;
+  size_t n = get_varint(data + offset, size - offset, message.shot);
+  if (n == 0) {
+    return 0;
+  }
+  offset += n;
+  n = get_varint(data + offset, size - offset, message.number);
+  if (n == 0) {
+    return 0;
+  }
+  offset += n;
+  n = get_varint(data + offset, size - offset, message.version);
+  if (n == 0) {
+    return 0;
+  }
+  offset += n;
+  message.part = 0;
+  message.n_parts = 1;
+  if (in_parts) {
+    n = get_varint(data + offset, size - offset, message.part);
+    if (n == 0) {
+      return 0;
+    }
+    offset += n;
+    n = get_varint(data + offset, size - offset, message.n_parts);
+    if (n == 0 || message.n_parts == 0 || message.n_parts > MAX_PARTS || message.part >= message.n_parts) {
+      return 0;
+    }
+    offset += n;
+  }
+  message.values = IntSet{};
+  if (message.type == MessageType::ACK) {
+    return offset;
+  }
+  n = message.values.decode_chunk(data + offset, size - offset);
+  if (n == 0) {
+    return 0;
+  }
+  return offset + n;
+}
+
+uint64_t LatticeAgreement::partial_key(uint64_t peer, MessageType type, uint32_t shot_id) {
+  return peer << 33 | static_cast<uint64_t>(type == MessageType::NACK) << 32 | shot_id;
+}
+
+// Sets that came in parts are passed on once complete, each part counted
+// once, and their entry is then erased. A newer proposal number restarts the
+// set. Parts of older numbers are dropped, and so are parts of the same
+// number with another version or part count. Parts that would start an entry
+// that never completes are dropped too: those of a NACK the current round no
+// longer waits for, and those of a proposal already put back together that
+// the link delivers twice. Must hold _mutex.
+bool LatticeAgreement::reassemble(uint64_t peer, Message& message) {
+  if (message.n_parts == 1) {
+    return true;
+  }
+  if (message.type == MessageType::ACK || message.shot >= _n_shots || peer >= _stride) {
+    return false;
+  }
+  if (message.type == MessageType::NACK) {
+    const Shot& current = shot(message.shot);
+    if (current.id != message.shot || !current.active || current.number != message.number ||
+        current.answered[peer]) {
+      return false;
+    }
+  } else {
+    const std::vector<uint32_t>& assembled = _acceptors[message.shot].assembled;
+    if (peer < assembled.size() && message.number <= assembled[peer]) {
+      return false;
+    }
+  }
+  uint64_t key = partial_key(peer, message.type, message.shot);
+  Partial& partial = _partials[key];
+  if (message.number < partial.number) {
+    return false;
+  }
+  if (message.number > partial.number || partial.received.empty()) {
+    partial.number = message.number;
+    partial.version = message.version;
+    partial.received.assign(message.n_parts, false);
+    partial.missing = message.n_parts;
+    partial.values = IntSet{};
+  } else if (message.version != partial.version || message.n_parts != partial.received.size()) {
+    // A proposal the link delivered twice is answered twice. The values of
+    // each NACK only add up with its own version: the parts of the first
+    // one seen are kept, the other one is dropped.
+    return false;
+  }
+  if (partial.received[message.part]) {
+    return false;
+  }
+  partial.received[message.part] = true;
+  partial.missing--;
+  partial.values.merge(message.values);
+  if (partial.missing > 0) {
+    return false;
+  }
+  message.values = std::move(partial.values);
+  _partials.erase(key);
+  if (message.type == MessageType::PROPOSAL) {
+    std::vector<uint32_t>& assembled = _acceptors[message.shot].assembled;
+    if (assembled.empty()) {
+      assembled.resize(_stride, 0);
+    }
+    assembled[peer] = message.number;
+  }
+  return true;
+}
+
+// Must hold _mutex.
+void LatticeAgreement::on_message(uint64_t peer, Message& message) {
+  if (!reassemble(peer, message)) {
+    return;
+  }
+  switch (message.type) {
+    case MessageType::PROPOSAL:
+      accept(peer, message.shot, message.number, message.version, message.values);
+      break;
+    case MessageType::ACK:
+      on_answer(peer, message.shot, message.number, true, message.version, message.values);
+      break;
+    case MessageType::NACK:
+      on_answer(peer, message.shot, message.number, false, message.version, message.values);
+      break;
+    default:
+      break;
+  }
+}
+
+// A packet is a sequence of messages. Malformed ones end it, but the packet
+// is taken: a retransmission would not fix it.
+bool LatticeAgreement::on_packet(uint64_t peer, const PacketView& pkt) {
+  const uint8_t *data = pkt.data();
+  size_t size = pkt.data_size();
+  size_t offset = 0;
+  Message message;
+  std::lock_guard<std::mutex> lock(_mutex);
+  while (offset < size) {
+    size_t n = decode_message(data + offset, size - offset, message);
+    if (n == 0) {
+      break;
+    }
+    offset += n;
+    on_message(peer, message);
+  }
+  if (_queued) {
+    _queued = false;
+    _pl.send_signal().raise();
+  }
+  return true;
+}
+
+// Packs up to MESSAGES_PER_PACKET messages queued for the peer, oldest
+// first, into a packet.
+size_t LatticeAgreement::next_packet(uint64_t peer, WireFormat format, uint8_t *data, uint8_t& flags) {
+  (void) format;
+  flags = 0;
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::deque<Outgoing>& queue = _queues[peer];
+  size_t size = 0;
+  uint32_t n_messages = 0;
+  while (!queue.empty() && n_messages < MESSAGES_PER_PACKET) {
+    Outgoing& message = queue.front();
+    if (stale(message)) {
+      queue.pop_front();
+      continue;
+    }
+    size_t n = encode_message(message, data + size, LATTICE_PACKET_SIZE - size);
+    if (n == 0) {
+      break;
+    }
+    size += n;
+    n_messages++;
+    _messages.fetch_add(1, std::memory_order_relaxed);
+    _bytes.fetch_add(n, std::memory_order_relaxed);
+    message.part++;
+    if (message.set == nullptr || message.part == message.set->ends.size()) {
+      queue.pop_front();
+    }
+  }
+  if (size > 0) {
+    _packets.fetch_add(1, std::memory_order_relaxed);
+  }
+  return size;
+}
+
+void LatticeAgreement::run() {
+  const int initial_interval_ms = 1;
+  const int max_interval_ms = 50;
+  int timeout_interval_ms = initial_interval_ms;
+
+  while (true) {
+    auto next_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_stop) {
+        break;
+      }
+      open_shots();
+      _queued = false;
+    }
+
+    if (!_pl.send_round(_log, next_deadline)) {
+      // The socket buffer is full, give the receivers time to drain it.
+      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_interval_ms));
+      timeout_interval_ms = std::min(2 * timeout_interval_ms, max_interval_ms);
+      continue;
+    }
+    timeout_interval_ms = initial_interval_ms;
+    // Sleep until a timer expires, an ACK makes room in a window or there is
+    // something new to send.
+    _pl.send_signal().wait_until(next_deadline);
+  }
+
+  print_stats();
+}
+
+// Bytes are those of the messages, the payloads of the packets, per shot
+// this process decided.
+void LatticeAgreement::print_stats() {
+  SendStats stats = _pl.send_stats();
+  uint64_t decided = _n_decided.load();
+  std::cerr << "Lattice agreement stopped: decided " << decided << " of " << _n_shots
+            << " shots in " << _rounds.load() << " rounds, sent " << _messages.load()
+            << " messages, " << _bytes.load() << " bytes (" << _bytes.load() / std::max<uint64_t>(decided, 1)
+            << " per decision) in " << _packets.load() << " packets, retransmitted "
+            << stats.retransmissions << " of " << stats.transmissions << " transmissions" << std::endl;
+}
+
+void LatticeAgreement::stop() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _pl.send_signal().raise();
+}
+
+uint64_t LatticeAgreement::decided() const {
+  return _n_decided.load();
+}
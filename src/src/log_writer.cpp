@@ -0,0 +1,486 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "log_writer.hpp"
+
+// Blocks written with a single pwritev().
+constexpr static size_t MAX_WRITE_BLOCKS = 64;
+// How long the writer sleeps when no producer wakes it.
+constexpr static std::chrono::milliseconds WRITER_INTERVAL{50};
+
+static std::atomic<uint64_t> next_writer_id{1};
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Two digits per step from the end of a scratch buffer, then one copy.
+char *format_uint(char *out, uint64_t value) {
+  char scratch[20];
+  char *p = scratch + sizeof(scratch);
+  while (value >= 100) {
+    size_t pair = (value % 100) * 2;
+    value /= 100;
+    p -= 2;
+    std::memcpy(p, DIGIT_PAIRS + pair, 2);
+  }
+  if (value >= 10) {
+    p -= 2;
+    std::memcpy(p, DIGIT_PAIRS + value * 2, 2);
+  } else {
+    *--p = static_cast<char>('0' + value);
+  }
+  auto len = static_cast<size_t>(scratch + sizeof(scratch) - p);
+  std::memcpy(out, p, len);
+  return out + len;
+}
+
+LogWriter::LogWriter(const std::string& path, OutputMode mode)
+        : _id(next_writer_id.fetch_add(1)), _mode(mode) {
+  // Read access too, mmap() needs it even for a write-only mapping.
+  _fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (_fd < 0) {
+    perror("open of the output file failed");
+    exit(EXIT_FAILURE);
+  }
+  if (_mode == OutputMode::MAPPED && !map_file()) {
+    std::cerr << "Falling back to the buffered output file" << std::endl;
+    _mode = OutputMode::BUFFERED;
+  }
+}
+
+// Allocates the blocks up front, so stores into the mapping never fault on a
+// full disk, and maps the whole file.
+bool LogWriter::map_file() {
+  if (fallocate(_fd, 0, 0, static_cast<off_t>(MAX_OUTPUT_SIZE)) < 0) {
+    perror("fallocate of the output file failed");
+    return false;
+  }
+  void *map = mmap(nullptr, MAX_OUTPUT_SIZE, PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap of the output file failed");
+    if (ftruncate(_fd, 0) < 0) {
+      perror("ftruncate of the output file failed");
+      exit(EXIT_FAILURE);
+    }
+    return false;
+  }
+  _map = static_cast<char *>(map);
+  return true;
+}
+
+LogWriter::~LogWriter() {
+  close();
+  for (size_t i = 0; i < _n_buffers.load(); i++) {
+    ThreadBuffer *buffer = _buffers[i].load();
+    if (buffer != nullptr) {
+      free_block(buffer->block);
+      delete buffer;
+    }
+  }
+}
+
+LogWriter::ThreadBuffer *LogWriter::thread_buffer() {
+  // One buffer per thread and writer. Writers are told apart by id, a new
+  // one may live at the address of a destroyed one.
+  thread_local uint64_t owner = 0;
+  thread_local ThreadBuffer *buffer = nullptr;
+  if (owner != _id) {
+    buffer = register_thread();
+    owner = _id;
+  }
+  return buffer;
+}
+
+LogWriter::ThreadBuffer *LogWriter::register_thread() {
+  size_t index = _n_buffers.fetch_add(1);
+  if (index >= MAX_LOG_THREADS) {
+    std::cerr << "Too many threads writing to the output log" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  auto *buffer = new ThreadBuffer();
+  buffer->owner = std::this_thread::get_id();
+  buffer->block = new_block();
+  _buffers[index].store(buffer);
+  return buffer;
+}
+
+void LogWriter::acquire(ThreadBuffer *buffer) {
+  while (buffer->busy.exchange(true, std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+}
+
+void LogWriter::release(ThreadBuffer *buffer) {
+  buffer->busy.store(false, std::memory_order_release);
+}
+
+OutputMode LogWriter::mode() const {
+  return _mode;
+}
+
+BufferPoolStats LogWriter::block_stats() const {
+  return _blocks.stats();
+}
+
+void LogWriter::append(const char *line, size_t len) {
+  if (_map != nullptr) {
+    append_mapped(line, len);
+    return;
+  }
+  ThreadBuffer *buffer = thread_buffer();
+  acquire(buffer);
+  // seal() flushes every buffer after setting the flag, taking them in turn,
+  // so a line that makes it into a block is written.
+  if (_sealed.load(std::memory_order_relaxed)) {
+    release(buffer);
+    return;
+  }
+  if (buffer->block->used + len > LOG_BLOCK_SIZE) {
+    hand_off(buffer->block);
+    buffer->block = new_block();
+  }
+  std::memcpy(buffer->block->data + buffer->block->used, line, len);
+  buffer->block->used += len;
+  release(buffer);
+}
+
+void LogWriter::sync(std::thread::id thread) {
+  if (_map != nullptr) {
+    return;
+  }
+  size_t n_buffers = std::min(_n_buffers.load(), MAX_LOG_THREADS);
+  for (size_t i = 0; i < n_buffers; i++) {
+    ThreadBuffer *buffer = _buffers[i].load();
+    if (buffer == nullptr || buffer->owner != thread) {
+      continue;
+    }
+    acquire(buffer);
+    if (buffer->block->used > 0) {
+      hand_off(buffer->block);
+      buffer->block = new_block();
+    }
+    release(buffer);
+    return;
+  }
+}
+
+// Lines that do not fit are dropped. Once one did not fit no later one can,
+// its offset is where the file ends.
+void LogWriter::append_mapped(const char *line, size_t len) {
+  _mapped_appends.fetch_add(1);
+  if (!_sealed.load()) {
+    uint64_t offset = _reserved.fetch_add(len, std::memory_order_relaxed);
+    if (offset + len <= MAX_OUTPUT_SIZE) {
+      std::memcpy(_map + offset, line, len);
+    } else {
+      uint64_t end = _map_end.load(std::memory_order_relaxed);
+      while (offset < end && !_map_end.compare_exchange_weak(end, offset)) {
+      }
+      if (!_oversize_reported.exchange(true)) {
+        std::cerr << "Output exceeds " << MAX_OUTPUT_SIZE << " bytes" << std::endl;
+      }
+    }
+  }
+  _mapped_appends.fetch_sub(1, std::memory_order_release);
+}
+
+uint64_t LogWriter::mapped_size() const {
+  return std::min(_reserved.load(), _map_end.load());
+}
+
+void LogWriter::append_line(char event, uint64_t value) {
+  char line[MAX_LOG_LINE_SIZE];
+  char *p = line;
+  *p++ = event;
+  *p++ = ' ';
+  p = format_uint(p, value);
+  *p++ = '\n';
+  append(line, static_cast<size_t>(p - line));
+}
+
+void LogWriter::append_line(char event, uint64_t first, uint64_t second) {
+  char line[MAX_LOG_LINE_SIZE];
+  char *p = line;
+  *p++ = event;
+  *p++ = ' ';
+  p = format_uint(p, first);
+  *p++ = ' ';
+  p = format_uint(p, second);
+  *p++ = '\n';
+  append(line, static_cast<size_t>(p - line));
+}
+
+// The lines of a run only differ in their last number, which is formatted
+// once and then incremented in place.
+void LogWriter::append_run(const char *prefix, size_t prefix_len, uint64_t first, uint64_t count) {
+  char chunk[LOG_RUN_CHUNK_SIZE];
+  size_t used = 0;
+  char digits[21];
+  auto n_digits = static_cast<size_t>(format_uint(digits, first) - digits);
+  for (uint64_t i = 0; i < count; i++) {
+    if (used + prefix_len + n_digits + 1 > sizeof(chunk)) {
+      append(chunk, used);
+      used = 0;
+    }
+    std::memcpy(chunk + used, prefix, prefix_len);
+    used += prefix_len;
+    std::memcpy(chunk + used, digits, n_digits);
+    used += n_digits;
+    chunk[used++] = '\n';
+
+    size_t k = n_digits;
+    while (k > 0 && digits[k - 1] == '9') {
+      digits[--k] = '0';
+    }
+    if (k > 0) {
+      digits[k - 1]++;
+    } else {
+      std::memmove(digits + 1, digits, n_digits++);
+      digits[0] = '1';
+    }
+  }
+  if (used > 0) {
+    append(chunk, used);
+  }
+}
+
+void LogWriter::append_lines(char event, uint64_t first, uint64_t count) {
+  const char prefix[] = {event, ' '};
+  append_run(prefix, sizeof(prefix), first, count);
+}
+
+void LogWriter::append_lines(char event, uint64_t value, uint64_t first, uint64_t count) {
+  char prefix[MAX_LOG_LINE_SIZE];
+  char *p = prefix;
+  *p++ = event;
+  *p++ = ' ';
+  p = format_uint(p, value);
+  *p++ = ' ';
+  append_run(prefix, static_cast<size_t>(p - prefix), first, count);
+}
+
+// The line goes out in a single append, so that seal() cannot cut it short,
+// unless it is longer than a block.
+void LogWriter::append_values(const uint32_t *values, size_t n) {
+  // Up to 10 digits and a separator per value.
+  std::vector<char> line(n * 11 + 1);
+  char *p = line.data();
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0) {
+      *p++ = ' ';
+    }
+    p = format_uint(p, values[i]);
+  }
+  *p++ = '\n';
+  auto len = static_cast<size_t>(p - line.data());
+  for (size_t offset = 0; offset < len; offset += LOG_BLOCK_SIZE) {
+    append(line.data() + offset, std::min(LOG_BLOCK_SIZE, len - offset));
+  }
+}
+
+void LogWriter::push(std::atomic<Block *> &stack, Block *block) {
+  block->next = stack.load(std::memory_order_relaxed);
+  while (!stack.compare_exchange_weak(block->next, block, std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+// Lock-free push; the writer is only woken up, it takes the blocks itself.
+void LogWriter::hand_off(Block *block) {
+  push(_full, block);
+  _writer_cv.notify_one();
+}
+
+// Takes every full block at once, oldest first.
+LogWriter::Block *LogWriter::take_full() {
+  Block *blocks = _full.exchange(nullptr, std::memory_order_acquire);
+  Block *ordered = nullptr;
+  while (blocks != nullptr) {
+    Block *next = blocks->next;
+    blocks->next = ordered;
+    ordered = blocks;
+    blocks = next;
+  }
+  return ordered;
+}
+
+LogWriter::Block *LogWriter::new_block() {
+  return new (_blocks.take()) Block();
+}
+
+void LogWriter::free_block(Block *block) {
+  block->~Block();
+  _blocks.give(block);
+}
+
+// Writes a list of blocks in as few pwritev() calls as possible and gives
+// them back to the pool.
+void LogWriter::write_blocks(Block *blocks) {
+  while (blocks != nullptr) {
+    struct iovec iov[MAX_WRITE_BLOCKS];
+    Block *written[MAX_WRITE_BLOCKS];
+    size_t n = 0;
+    size_t size = 0;
+    while (blocks != nullptr && n < MAX_WRITE_BLOCKS) {
+      iov[n].iov_base = blocks->data;
+      iov[n].iov_len = blocks->used;
+      written[n] = blocks;
+      n++;
+      size += blocks->used;
+      blocks = blocks->next;
+    }
+    write_iov(iov, static_cast<int>(n), size);
+    for (size_t i = 0; i < n; i++) {
+      free_block(written[i]);
+    }
+  }
+}
+
+// Callers hold the write lock, which keeps the file offset consistent.
+void LogWriter::write_iov(struct iovec *iov, int count, size_t size) {
+  uint64_t offset = _offset;
+  _offset += size;
+  if (offset + size > MAX_OUTPUT_SIZE && !_oversize_reported.exchange(true)) {
+    std::cerr << "Output exceeds " << MAX_OUTPUT_SIZE << " bytes" << std::endl;
+  }
+  while (count > 0) {
+    ssize_t written = pwritev(_fd, iov, count, static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("pwritev of the output file failed");
+      exit(EXIT_FAILURE);
+    }
+    // Short write: skip what made it to the file.
+    offset += static_cast<uint64_t>(written);
+    auto left = static_cast<size_t>(written);
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+      iov->iov_len -= left;
+    }
+  }
+}
+
+// Body of the writer thread, returns once stop() is called. Nothing to do
+// in MAPPED mode.
+void LogWriter::run() {
+  if (_map != nullptr) {
+    return;
+  }
+  while (!_stop_writer.load()) {
+    {
+      std::unique_lock<std::mutex> lock(_writer_mutex);
+      _writer_cv.wait_for(lock, WRITER_INTERVAL, [this] {
+        return _stop_writer.load() || _full.load(std::memory_order_relaxed) != nullptr;
+      });
+    }
+    std::lock_guard<std::mutex> lock(_write_mutex);
+    write_blocks(take_full());
+  }
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  write_blocks(take_full());
+}
+
+void LogWriter::stop() {
+  {
+    std::lock_guard<std::mutex> lock(_writer_mutex);
+    _stop_writer.store(true);
+  }
+  _writer_cv.notify_all();
+}
+
+// Writes everything appended so far, partially filled blocks included, and
+// waits for it to reach the disk. Safe to call from any thread, appends in
+// progress are waited for.
+void LogWriter::flush() {
+  if (_map != nullptr) {
+    if (msync(_map, mapped_size(), MS_SYNC) < 0) {
+      perror("msync of the output file failed");
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_write_mutex);
+    size_t n_buffers = std::min(_n_buffers.load(), MAX_LOG_THREADS);
+    for (size_t i = 0; i < n_buffers; i++) {
+      ThreadBuffer *buffer = _buffers[i].load();
+      if (buffer == nullptr) {
+        continue;
+      }
+      acquire(buffer);
+      // The thread's full blocks are older than its partial one and cannot
+      // grow while we hold its buffer.
+      write_blocks(take_full());
+      Block *block = buffer->block;
+      if (block->used > 0) {
+        struct iovec iov{block->data, block->used};
+        write_iov(&iov, 1, block->used);
+        block->used = 0;
+      }
+      release(buffer);
+    }
+    write_blocks(take_full());
+  }
+  if (fdatasync(_fd) < 0) {
+    perror("fdatasync of the output file failed");
+  }
+}
+
+// Stops taking lines and flushes the ones appended so far. A mapped file is
+// cut down to the bytes reserved, once the appends still in progress, which
+// lie within them, are done.
+void LogWriter::seal() {
+  _sealed.store(true);
+  if (_map == nullptr) {
+    flush();
+    return;
+  }
+  // Sequentially consistent, like the store to _sealed and the accesses in
+  // append_mapped(): either the append sees _sealed, or this sees the append.
+  while (_mapped_appends.load() > 0) {
+    std::this_thread::yield();
+  }
+  flush();
+  if (ftruncate(_fd, static_cast<off_t>(mapped_size())) < 0) {
+    perror("ftruncate of the output file failed");
+  }
+  if (fdatasync(_fd) < 0) {
+    perror("fdatasync of the output file failed");
+  }
+}
+
+// Final flush; appends made afterwards are lost.
+void LogWriter::close() {
+  if (_fd < 0) {
+    return;
+  }
+  if (_map != nullptr) {
+    seal();
+    munmap(_map, MAX_OUTPUT_SIZE);
+    _map = nullptr;
+  } else {
+    flush();
+  }
+  ::close(_fd);
+  _fd = -1;
+}
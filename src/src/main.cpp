@@ -2,31 +2,22 @@
 #include <iostream>
 #include <thread>
 #include <csignal>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "config.hpp"
 #include "parser.hpp"
 #include "process.hpp"
 
-std::mutex signal_handler_mutex;
-std::function<void()> signal_handler;
-
-static void stop(int) {
-  // reset signal handlers to default
-  signal(SIGTERM, SIG_DFL);
-  signal(SIGINT, SIG_DFL);
-
-  signal_handler();
-
-//  std::cerr << "Stop requested" << std::endl;
-
-  // exit directly from signal handler
-//  exit(0);
-}
-
-static void register_signals() {
-  // register signal handlers
-  signal(SIGTERM, stop);
-  signal(SIGINT, stop);
+// Blocked in every thread, the process receives them through the event loop.
+static void block_signals() {
+  sigset_t signals = Process::shutdown_signals();
+  if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0) {
+    std::cerr << "Failed to block shutdown signals" << std::endl;
+    exit(1);
+  }
 }
 
 static Config read_config_file(const std::string &configPath) {
@@ -36,13 +27,42 @@ static Config read_config_file(const std::string &configPath) {
     exit(1);
   }
 
-  uint32_t n_messages, receiver_proc;
-  if (!(config_file >> n_messages >> receiver_proc)) {
+  // "m i" for perfect links, "m" for FIFO broadcast, "p vs ds" and the
+  // proposals for lattice agreement.
+  std::string line;
+  std::getline(config_file, line);
+  std::istringstream values(line);
+  uint32_t header[3];
+  size_t n_values = 0;
+  while (n_values < 3 && values >> header[n_values]) {
+    n_values++;
+  }
+  if (n_values == 0) {
     std::cerr << "Failed to read config values from: " << configPath << std::endl;
     exit(1);
   }
+  if (n_values == 1) {
+    return Config(header[0]);
+  }
+  if (n_values == 2) {
+    return {header[0], header[1]};
+  }
 
-  return {n_messages, receiver_proc};
+  Config cfg(header[0], header[1], header[2]);
+  for (uint32_t shot = 0; shot < cfg.n_proposals(); shot++) {
+    if (!std::getline(config_file, line)) {
+      std::cerr << "Failed to read proposal " << shot + 1 << " from: " << configPath << std::endl;
+      exit(1);
+    }
+    std::istringstream proposal_values(line);
+    std::vector<uint32_t> proposal;
+    uint32_t value;
+    while (proposal_values >> value) {
+      proposal.push_back(value);
+    }
+    cfg.add_proposal(std::move(proposal));
+  }
+  return cfg;
 }
 
 static int run_process(Parser &parser, const Config& cfg) {
@@ -63,13 +83,6 @@ static int run_process(Parser &parser, const Config& cfg) {
   Process process(parser.id(), current_host.ip, current_host.port,
                   parser.hosts(), cfg, parser.outputPath());
 
-//  {
-//    std::lock_guard<std::mutex> lock(signal_handler_mutex);
-//    signal_handler = [&process]() { process.stop(); };
-//  }
-
-  signal_handler = [&process]() { process.stop(); };
-
   std::cerr << "I am process with id: " << process.pid() << std::endl;
 
   process.run(cfg);
@@ -79,7 +92,7 @@ static int run_process(Parser &parser, const Config& cfg) {
 }
 
 int main(int argc, char **argv) {
-  register_signals();
+  block_signals();
   Parser parser(argc, argv);
   parser.parse();
   Config cfg = read_config_file(parser.configPath());
@@ -1,66 +1,217 @@
-#include <iostream>
-#include <cassert>
 #include "packet.hpp"
 
-Packet::Packet(uint64_t pid, PacketType type, uint32_t seq_id)
-    : _pid(pid), _type(type), _seq_id(seq_id) {}
+size_t varint_size(uint32_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
 
-Packet::Packet(uint64_t pid, PacketType type, uint32_t seq_id, const std::vector<uint8_t>& data)
-    : _pid(pid), _type(type), _seq_id(seq_id), _data(data) {}
+size_t put_varint(uint8_t *buffer, uint32_t value) {
+  size_t offset = 0;
+  while (value >= 0x80) {
+    buffer[offset++] = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  buffer[offset++] = static_cast<uint8_t>(value);
+  return offset;
+}
 
-uint64_t Packet::pid() const {
-  return _pid;
+size_t get_varint(const uint8_t *buffer, size_t size, uint32_t& value) {
+  value = 0;
+  for (size_t i = 0; i < size && i < MAX_VARINT32_SIZE; i++) {
+    // The fifth byte holds the top 4 bits, anything above would be lost.
+    if (i == MAX_VARINT32_SIZE - 1 && buffer[i] > 0x0F) {
+      return 0;
+    }
+    value |= static_cast<uint32_t>(buffer[i] & 0x7F) << (7 * i);
+    if ((buffer[i] & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
 }
 
-PacketType Packet::packet_type() const {
-  return _type;
+PacketView::PacketView(const PacketHeader& header, const uint8_t *data)
+    : _header(header), _data(data) {}
+
+// Returns false if the buffer is too short for the header or for the payload
+// length the header announces.
+bool PacketView::decode(const uint8_t *buffer, size_t size) {
+  if (size > 0 && (buffer[0] & ~COMPACT_VERSION_MASK) == COMPACT_MARKER) {
+    return decode_compact(buffer, size);
+  }
+  return decode_legacy(buffer, size);
 }
 
-uint32_t Packet::seq_id() const {
-  return _seq_id;
+bool PacketView::decode_legacy(const uint8_t *buffer, size_t size) {
+  if (size < HEADER_SIZE) {
+    return false;
+  }
+  size_t offset = 0;
+
+  std::memcpy(&_header.pid, buffer + offset, sizeof(_header.pid));
+  offset += sizeof(_header.pid);
+
+  std::memcpy(&_header.type, buffer + offset, sizeof(_header.type));
+  offset += sizeof(_header.type);
+
+  std::memcpy(&_header.seq_id, buffer + offset, sizeof(_header.seq_id));
+  offset += sizeof(_header.seq_id);
+
+  std::memcpy(&_header.data_size, buffer + offset, sizeof(_header.data_size));
+  offset += sizeof(_header.data_size);
+  _header.flags = 0;
+
+  if (_header.data_size > size - offset) {
+    return false;
+  }
+  _data = buffer + offset;
+  _format = WireFormat::LEGACY;
+  _size = offset + _header.data_size;
+  return true;
 }
 
-const std::vector<uint8_t>& Packet::data() const {
-  return _data;
+// Every format from COMPACT on shares the frame layout, the version nibble
+// tells whether more frames may follow and whether the flags are meaningful.
+bool PacketView::decode_compact(const uint8_t *buffer, size_t size) {
+  uint8_t version = buffer[0] & COMPACT_VERSION_MASK;
+  if (size < 1 + 1 + sizeof(uint16_t) ||
+      version < static_cast<uint8_t>(WireFormat::COMPACT) ||
+      version > static_cast<uint8_t>(LATEST_WIRE_FORMAT)) {
+    return false;
+  }
+  size_t offset = 1;
+
+  _header.type = static_cast<PacketType>(buffer[offset] & COMPACT_TYPE_MASK);
+  _header.flags = version >= static_cast<uint8_t>(WireFormat::PAYLOAD_FLAGS) ?
+                  buffer[offset] & COMPACT_FLAGS_MASK : 0;
+  offset += 1;
+
+  _header.pid = static_cast<uint64_t>(buffer[offset]) |
+                static_cast<uint64_t>(buffer[offset + 1]) << 8;
+  offset += sizeof(uint16_t);
+
+  size_t n = get_varint(buffer + offset, size - offset, _header.seq_id);
+  if (n == 0) {
+    return false;
+  }
+  offset += n;
+
+  n = get_varint(buffer + offset, size - offset, _header.data_size);
+  if (n == 0) {
+    return false;
+  }
+  offset += n;
+
+  if (_header.data_size > size - offset) {
+    return false;
+  }
+  _data = buffer + offset;
+  _format = static_cast<WireFormat>(version);
+  _size = offset + _header.data_size;
+  return true;
 }
 
-std::vector<uint8_t> Packet::serialize() const {
-  std::vector<uint8_t> buffer;
+WireFormat PacketView::wire_format() const {
+  return _format;
+}
 
-  auto bytes = reinterpret_cast<const uint8_t*>(&_pid);
-  buffer.insert(buffer.end(), bytes, bytes + sizeof(_pid));
+uint64_t PacketView::pid() const {
+  return _header.pid;
+}
 
-  bytes = reinterpret_cast<const uint8_t*>(&_type);
-  buffer.insert(buffer.end(), bytes, bytes + sizeof(_type));
+PacketType PacketView::packet_type() const {
+  return _header.type;
+}
 
-  bytes = reinterpret_cast<const uint8_t*>(&_seq_id);
-  buffer.insert(buffer.end(), bytes, bytes + sizeof(_seq_id));
+uint32_t PacketView::seq_id() const {
+  return _header.seq_id;
+}
 
-  auto data_size = static_cast<uint32_t>(_data.size());
-  bytes = reinterpret_cast<const uint8_t*>(&data_size);
-  buffer.insert(buffer.end(), bytes, bytes + sizeof(data_size));
-  buffer.insert(buffer.end(), _data.begin(), _data.end());
+uint8_t PacketView::flags() const {
+  return _header.flags;
+}
 
-  return buffer;
+const uint8_t *PacketView::data() const {
+  return _data;
+}
+
+size_t PacketView::data_size() const {
+  return _header.data_size;
+}
+
+size_t PacketView::size() const {
+  return _size;
+}
+
+// Returns the number of bytes written, or 0 if the packet does not fit.
+size_t PacketView::encode(uint8_t *buffer, size_t capacity, const PacketHeader& header,
+                          const uint8_t *data, WireFormat format) {
+  switch (format) {
+    case WireFormat::LEGACY:
+      return encode_legacy(buffer, capacity, header, data);
+    case WireFormat::COMPACT:
+    case WireFormat::COALESCED:
+    case WireFormat::PAYLOAD_FLAGS:
+    case WireFormat::ACK_VECTORS:
+      return encode_compact(buffer, capacity, header, data, format);
+    default:
+      return 0;
+  }
 }
 
-void Packet::deserialize(const std::vector<uint8_t> &buffer) {
-  assert(buffer.size() >= HEADER_SIZE);
+size_t PacketView::encode_legacy(uint8_t *buffer, size_t capacity,
+                                 const PacketHeader& header, const uint8_t *data) {
+  if (header.flags != 0 || capacity < HEADER_SIZE + header.data_size) {
+    return 0;
+  }
   size_t offset = 0;
 
-  std::memcpy(&_pid, buffer.data() + offset, sizeof(_pid));
-  offset += sizeof(_pid);
+  std::memcpy(buffer + offset, &header.pid, sizeof(header.pid));
+  offset += sizeof(header.pid);
+
+  std::memcpy(buffer + offset, &header.type, sizeof(header.type));
+  offset += sizeof(header.type);
 
-  std::memcpy(&_type, buffer.data() + offset, sizeof(_type));
-  offset += sizeof(_type);
+  std::memcpy(buffer + offset, &header.seq_id, sizeof(header.seq_id));
+  offset += sizeof(header.seq_id);
 
-  std::memcpy(&_seq_id, buffer.data() + offset, sizeof(_seq_id));
-  offset += sizeof(_seq_id);
+  std::memcpy(buffer + offset, &header.data_size, sizeof(header.data_size));
+  offset += sizeof(header.data_size);
 
-  uint32_t data_size;
-  std::memcpy(&data_size, buffer.data() + offset, sizeof(data_size));
-  offset += sizeof(data_size);
+  if (header.data_size > 0) {
+    std::memcpy(buffer + offset, data, header.data_size);
+    offset += header.data_size;
+  }
 
-  _data.resize(data_size);
-  std::memcpy(_data.data(), buffer.data() + offset, data_size);
-}
\ No newline at end of file
+  return offset;
+}
+
+size_t PacketView::encode_compact(uint8_t *buffer, size_t capacity, const PacketHeader& header,
+                                  const uint8_t *data, WireFormat format) {
+  size_t header_size = 1 + 1 + sizeof(uint16_t) +
+                       varint_size(header.seq_id) + varint_size(header.data_size);
+  if (header.pid > UINT16_MAX || capacity < header_size + header.data_size ||
+      (header.flags != 0 && format < WireFormat::PAYLOAD_FLAGS)) {
+    return 0;
+  }
+  size_t offset = 0;
+
+  buffer[offset++] = COMPACT_MARKER | static_cast<uint8_t>(format);
+  buffer[offset++] = static_cast<uint8_t>((static_cast<uint8_t>(header.type) & COMPACT_TYPE_MASK) |
+                                         (header.flags & COMPACT_FLAGS_MASK));
+  buffer[offset++] = static_cast<uint8_t>(header.pid);
+  buffer[offset++] = static_cast<uint8_t>(header.pid >> 8);
+  offset += put_varint(buffer + offset, header.seq_id);
+  offset += put_varint(buffer + offset, header.data_size);
+
+  if (header.data_size > 0) {
+    std::memcpy(buffer + offset, data, header.data_size);
+    offset += header.data_size;
+  }
+
+  return offset;
+}
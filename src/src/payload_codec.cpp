@@ -0,0 +1,38 @@
+#include "payload_codec.hpp"
+
+static size_t encode_raw(const uint32_t *ids, size_t n, uint8_t *out) {
+  std::memcpy(out, ids, n * sizeof(uint32_t));
+  return n * sizeof(uint32_t);
+}
+
+size_t encode_messages(const uint32_t *ids, size_t n, WireFormat format,
+                       uint8_t *out, uint8_t& flags) {
+  flags = PAYLOAD_RAW;
+  if (format < WireFormat::PAYLOAD_FLAGS || n == 0) {
+    return encode_raw(ids, n, out);
+  }
+
+  bool run = true;
+  size_t delta_size = varint_size(ids[0]);
+  for (size_t i = 1; i < n; i++) {
+    uint32_t gap = ids[i] - ids[i - 1] - 1;
+    run = run && gap == 0;
+    delta_size += varint_size(gap);
+  }
+
+  size_t raw_size = n * sizeof(uint32_t);
+  if (run && varint_size(ids[0]) + varint_size(static_cast<uint32_t>(n)) < raw_size) {
+    flags = PAYLOAD_RUN;
+    size_t size = put_varint(out, ids[0]);
+    return size + put_varint(out + size, static_cast<uint32_t>(n));
+  }
+  if (delta_size < raw_size) {
+    flags = PAYLOAD_DELTA;
+    size_t size = put_varint(out, ids[0]);
+    for (size_t i = 1; i < n; i++) {
+      size += put_varint(out + size, ids[i] - ids[i - 1] - 1);
+    }
+    return size;
+  }
+  return encode_raw(ids, n, out);
+}
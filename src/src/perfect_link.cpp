@@ -1,40 +1,121 @@
+#include <algorithm>
 #include <cassert>
 #include <utility>
 #include "perfect_link.hpp"
 #include "packet.hpp"
 
+// Kernel receive buffer requested for the shared socket, capped by
+// net.core.rmem_max.
+constexpr static int SHARED_RECV_BUF_SIZE = 8 * 1024 * 1024;
+// A partially delivered block at the watermark must not push the tail of the
+// sender's window out of the delivered ring.
+static_assert(DELIVERED_WINDOW_BITS >= max_window_size + DELIVERED_WORD_BITS,
+              "delivered window must cover the send window");
+
 PerfectLink::PerfectLink(uint64_t pid, in_addr_t addr, uint16_t port, bool sender,
                          const std::vector<Parser::Host>& hosts, uint64_t receiver_proc,
                          EventLoop& event_loop, DeliverCallback deliver_cb) :
-                         _addr(addr), _port(port), _sender(sender) {
-  {
-    std::lock_guard<std::mutex> lock(_delivered_mutex);
-    _deliver_cb = std::move(deliver_cb);
-  }
-
-  if (sender) {
-    // Connect only to receiver.
-    for (const auto& host : hosts) {
-      if (host.id == receiver_proc) {
-        _sl_map[host.id] = new StubbornLink(pid, addr, port, host.ip, host.port,
-                                            sender, event_loop, [this](const Packet& pkt) {
-          this->deliver_packet(pkt);
-        });
-        break;
-      }
+                         _addr(addr), _port(port), _sender(sender),
+                         _deliver_cb(std::move(deliver_cb)), _socket(addr, port),
+                         _read_event_handler(&_socket,
+                                             [this](const PacketView& pkt, const struct sockaddr_in& source) {
+                                               this->process_packet(pkt, source);
+                                             },
+                                             [this]() { this->flush_sacks(); }) {
+  _socket.set_recv_buffer_size(SHARED_RECV_BUF_SIZE);
+
+  // Sender: connect only to receiver. Receiver: connect to all hosts except
+  // ourselves.
+  std::vector<const Parser::Host*> peers;
+  uint64_t max_peer_id = 0;
+  for (const auto& host : hosts) {
+    if (sender ? host.id == receiver_proc : host.id != pid) {
+      peers.push_back(&host);
+      max_peer_id = std::max(max_peer_id, host.id);
     }
-  } else {
-    // Receiver. Connect to all hosts except ourselves.
-    for (const auto& host : hosts) {
-      if (host.id == pid) {
-        continue;
-      }
-      _sl_map[host.id] = new StubbornLink(pid, addr, port, host.ip, host.port, sender, event_loop,
-                                          [this](const Packet& pkt) {
-                                              this->deliver_packet(pkt);
-                                          });
+  }
+  _links.resize(max_peer_id + 1, nullptr);
+  if (!sender) {
+    _delivered = std::vector<DeliveredWindow>(max_peer_id + 1);
+  }
+  // Every link advertises its share of the socket's receive buffer.
+  uint32_t window = advertised_window(peers.size());
+
+  for (const auto *host : peers) {
+    add_link(new StubbornLink(pid, _socket, host->ip, host->port, sender, window, _send_signal,
+                              [this, peer = host->id](const PacketView& pkt) {
+                                return this->deliver_packet(peer, pkt);
+                              }),
+             *host);
+  }
+  listen(event_loop);
+}
+
+PerfectLink::PerfectLink(uint64_t pid, in_addr_t addr, uint16_t port,
+                         const std::vector<Parser::Host>& hosts, EventLoop& event_loop,
+                         PeerAcceptCallback accept_cb, PeerPacketSource source,
+                         PeerAckVectorSource ack_vector_source, PeerAckVectorCallback ack_vector_cb,
+                         size_t max_data_size) :
+                         _addr(addr), _port(port), _sender(true), _socket(addr, port),
+                         _read_event_handler(&_socket,
+                                             [this](const PacketView& pkt, const struct sockaddr_in& source) {
+                                               this->process_packet(pkt, source);
+                                             },
+                                             [this]() { this->flush_sacks(); }) {
+  _socket.set_recv_buffer_size(SHARED_RECV_BUF_SIZE);
+
+  uint64_t max_peer_id = 0;
+  for (const auto& host : hosts) {
+    max_peer_id = std::max(max_peer_id, host.id);
+  }
+  _links.resize(max_peer_id + 1, nullptr);
+  uint32_t window = advertised_window(std::max<size_t>(hosts.size(), 2) - 1);
+
+  for (const auto& host : hosts) {
+    if (host.id == pid) {
+      continue;
+    }
+    AckVectorSource link_vector_source;
+    AckVectorCallback link_vector_cb;
+    if (ack_vector_source) {
+      link_vector_source = [ack_vector_source, peer = host.id](uint8_t *data, size_t capacity, bool standalone) {
+        return ack_vector_source(peer, data, capacity, standalone);
+      };
     }
+    if (ack_vector_cb) {
+      link_vector_cb = [ack_vector_cb, peer = host.id](const PacketView& pkt) {
+        ack_vector_cb(peer, pkt);
+      };
+    }
+    auto *sl = new StubbornLink(pid, _socket, host.ip, host.port, true, window, _send_signal,
+                                [accept_cb, peer = host.id](const PacketView& pkt) {
+                                  return accept_cb(peer, pkt);
+                                },
+                                [source, peer = host.id](WireFormat format, uint8_t *data, uint8_t& flags) {
+                                  return source(peer, format, data, flags);
+                                },
+                                std::move(link_vector_source), std::move(link_vector_cb), max_data_size);
+    add_link(sl, host);
+    _senders.push_back(sl);
   }
+  listen(event_loop);
+}
+
+uint32_t PerfectLink::advertised_window(size_t n_peers) const {
+  return static_cast<uint32_t>(std::max<size_t>(_socket.recv_capacity() / std::max<size_t>(n_peers, 1), 1));
+}
+
+void PerfectLink::add_link(StubbornLink *sl, const Parser::Host& host) {
+  _sl_map[host.id] = sl;
+  _links[host.id] = sl;
+  _links_by_addr[addr_key(host.ip, host.port)] = sl;
+  _sack_dirty.reserve(_sl_map.size());
+}
+
+void PerfectLink::listen(EventLoop& event_loop) {
+  _read_event_data.fd = _socket.infd();
+  _read_event_data.handler_obj = &_read_event_handler;
+  event_loop.add(EPOLLIN, &_read_event_data);
 }
 
 PerfectLink::~PerfectLink() {
@@ -43,29 +124,65 @@ PerfectLink::~PerfectLink() {
   }
 }
 
-void PerfectLink::deliver_packet(const Packet& pkt) {
-  if (!_sender) {
-    auto p = std::make_pair(pkt.pid(), pkt.seq_id());
-    {
-      std::lock_guard<std::mutex> lock(_delivered_mutex);
-      if (_delivered.find(p) != _delivered.end()) {
-        return;
-      }
-      _delivered.insert(p);
+uint64_t PerfectLink::addr_key(in_addr_t addr, uint16_t port) {
+  return static_cast<uint64_t>(addr) << 16 | port;
+}
 
-    }
-    _deliver_cb(pkt);
+// The sender id in the header picks the link, the source address confirms it.
+StubbornLink *PerfectLink::find_link(const PacketView& pkt, const struct sockaddr_in& source) const {
+  uint64_t id = pkt.pid();
+  if (id < _links.size() && _links[id] != nullptr && _links[id]->is_peer(source)) {
+    return _links[id];
+  }
+  auto it = _links_by_addr.find(addr_key(source.sin_addr.s_addr, source.sin_port));
+  return it != _links_by_addr.end() ? it->second : nullptr;
+}
+
+void PerfectLink::process_packet(const PacketView& pkt, const struct sockaddr_in& source) {
+  StubbornLink *sl = find_link(pkt, source);
+  if (sl == nullptr) {
+    // Not one of our peers.
+    return;
+  }
+  bool sack_was_pending = sl->sack_pending();
+  sl->process_packet(pkt);
+  if (!sack_was_pending && sl->sack_pending()) {
+    _sack_dirty.push_back(sl);
+  }
+}
+
+void PerfectLink::flush_sacks() {
+  for (auto *sl : _sack_dirty) {
+    sl->flush_sack();
+  }
+  _sack_dirty.clear();
+}
+
+// Returns false only for packets too far ahead of what has been delivered
+// from the peer, those must not be acknowledged yet.
+bool PerfectLink::deliver_packet(uint64_t peer, const PacketView& pkt) {
+  if (_sender) {
+    return true;
+  }
+  switch (_delivered[peer].mark(pkt.seq_id())) {
+    case MarkResult::DELIVER:
+      _deliver_cb(pkt);
+      return true;
+    case MarkResult::DUPLICATE:
+      return true;
+    case MarkResult::OUT_OF_WINDOW:
+    default:
+      return false;
   }
 }
 
-void PerfectLink::send(uint32_t n_messages, uint64_t peer, std::ofstream &outfile, std::mutex &outfile_mutex) {
+void PerfectLink::send(uint32_t n_messages, uint64_t peer, LogWriter &log) {
 //  _sl->send(p, addr);
 //  std::cerr << "[DEBUG] Sending to peer " << peer << std::endl;
-  _sl_map[peer]->send(n_messages, outfile, outfile_mutex);
+  _sl_map[peer]->send(n_messages, log);
 }
 
 void PerfectLink::send_syn_packets() {
-  const int interval_ms = 50;
   std::unordered_map<uint64_t, bool> syn_acked;
   for (const auto& sl : _sl_map) {
     syn_acked[sl.first] = false;
@@ -88,10 +205,46 @@ void PerfectLink::send_syn_packets() {
     if (all_acked || _stop.load()) {
       break;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    std::this_thread::sleep_for(SYN_INTERVAL);
   }
 }
 
+bool PerfectLink::send_round(LogWriter &log, std::chrono::steady_clock::time_point &next_deadline) {
+  // Start where the last round left off, so that a full socket buffer does
+  // not always leave the same links behind.
+  for (size_t i = 0; i < _senders.size(); i++) {
+    size_t index = (_next_sender + i) % _senders.size();
+    if (_senders[index]->send_step(log, next_deadline) == SendStep::BLOCKED) {
+      _next_sender = index;
+      return false;
+    }
+  }
+  return true;
+}
+
+SendSignal& PerfectLink::send_signal() {
+  return _send_signal;
+}
+
+// Summed over all links, RTO and cwnd are the largest of any link.
+SendStats PerfectLink::send_stats() {
+  SendStats total{};
+  for (auto& sl : _sl_map) {
+    SendStats stats = sl.second->send_stats();
+    total.rto = std::max(total.rto, stats.rto);
+    total.cwnd = std::max(total.cwnd, stats.cwnd);
+    total.transmissions += stats.transmissions;
+    total.retransmissions += stats.retransmissions;
+    total.datagrams += stats.datagrams;
+    total.control_datagrams += stats.control_datagrams;
+  }
+  return total;
+}
+
+RecvStats PerfectLink::recv_stats() const {
+  return _read_event_handler.stats();
+}
+
 void PerfectLink::stop() {
   for (auto& sl : _sl_map) {
     sl.second->stop();
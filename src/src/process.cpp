@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <utility>
 #include <netinet/in.h>
@@ -7,42 +9,182 @@
 #include <cassert>
 #include "process.hpp"
 #include "perfect_link.hpp"
+#include "payload_codec.hpp"
 
 Process::Process(uint64_t pid, in_addr_t addr, uint16_t port,
                  const std::vector<Parser::Host>& hosts, const Config &cfg,
                  const std::string& outfname)
-        : _pid(pid), _addr(addr), _port(port), _hosts(hosts), _outfile(outfname, std::ios::out | std::ios::trunc),
-          _n_messages(cfg.num_messages() * (_hosts.size() - 1)) {
+        : _pid(pid), _addr(addr), _port(port), _event_loop(event_loop_mode(), event_loop_workers),
+          _hosts(hosts), _log(outfname, output_mode()),
+          _n_messages(expected_messages(cfg, _hosts.size())) {
 
   std::cerr << "Expecting " << _n_messages << " messages" << std::endl;
 
-  if (cfg.receiver_proc() != _pid) {
+  if (cfg.kind() == ConfigKind::FIFO_BROADCAST) {
+    // Packets only arrive once the event loop workers below start.
+    _pl = new PerfectLink(pid, _addr, _port, _hosts, _event_loop,
+                          [this](uint64_t peer, const PacketView& pkt) {
+        return this->_fifo->on_relay(peer, pkt);
+    }, [this](uint64_t peer, WireFormat format, uint8_t *data, uint8_t& flags) {
+        return this->_fifo->next_relay(peer, format, data, flags);
+    }, [this](uint64_t peer, uint8_t *data, size_t capacity, bool standalone) {
+        return this->_fifo->ack_vector(peer, data, capacity, standalone);
+    }, [this](uint64_t peer, const PacketView& pkt) {
+        this->_fifo->on_ack_vector(peer, pkt);
+    });
+    _fifo = new FifoBroadcast(pid, _hosts, cfg.num_messages(), *_pl, _log);
+  } else if (cfg.kind() == ConfigKind::LATTICE_AGREEMENT) {
+    _pl = new PerfectLink(pid, _addr, _port, _hosts, _event_loop,
+                          [this](uint64_t peer, const PacketView& pkt) {
+        return this->_lattice->on_packet(peer, pkt);
+    }, [this](uint64_t peer, WireFormat format, uint8_t *data, uint8_t& flags) {
+        return this->_lattice->next_packet(peer, format, data, flags);
+    }, nullptr, nullptr, LATTICE_PACKET_SIZE);
+    _lattice = new LatticeAgreement(pid, _hosts, cfg, *_pl, _log);
+  } else if (cfg.receiver_proc() != _pid) {
     _pl = new PerfectLink(pid, _addr, _port, true, _hosts, cfg.receiver_proc(),
-                          _event_loop, [](const Packet& pkt) {
+                          _event_loop, [](const PacketView& pkt) {
         Process::sender_deliver_callback(pkt);
     });
   } else {
     _pl = new PerfectLink(pid, _addr, _port, false, _hosts, cfg.receiver_proc(),
-                          _event_loop, [this](const Packet& pkt) {
+                          _event_loop, [this](const PacketView& pkt) {
         this->receiver_deliver_callback(pkt);
     });
   }
 
-  _thread_pool = new ThreadPool(8);
+  // A mapped output file needs no writer thread.
+  bool buffered = _log.mode() == OutputMode::BUFFERED;
+  _thread_pool = new ThreadPool(task_workers);
+  if (buffered) {
+    _thread_pool->pin([this] {
+      this->_log.run();
+    });
+  }
+
+  _event_loop.watch_signals(shutdown_signals(), [this](int) {
+    this->stop();
+  });
 
   for (uint32_t i = 0; i < event_loop_workers; i++) {
-    _thread_pool->enqueue([this] {
+    _thread_pool->pin([this] {
       this->_event_loop.run();
     });
   }
 }
 
 Process::~Process() {
+  print_stats();
   std::cerr << "Goodbye from process " << _pid << std::endl;
+  _log.stop();
   _thread_pool->stop();
-  _outfile.close();
+  _log.close();
+  delete _fifo;
+  delete _lattice;
   delete _pl;
   delete _thread_pool;
+  if (_stopping.load()) {
+    auto elapsed = std::chrono::steady_clock::now() - _stop_requested_at;
+    std::cerr << "Stopped in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+              << " ms" << std::endl;
+  }
+}
+
+sigset_t Process::shutdown_signals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  return signals;
+}
+
+// DA_EVENT_LOOP=oneshot selects the shared EPOLLONESHOT loop, uring the
+// io_uring backend, anything else the per-thread edge-triggered one.
+EventLoopMode Process::event_loop_mode() {
+  const char *mode = std::getenv("DA_EVENT_LOOP");
+  if (mode != nullptr && std::strcmp(mode, "oneshot") == 0) {
+    return EventLoopMode::SHARED_ONESHOT;
+  }
+  if (mode != nullptr && std::strcmp(mode, "uring") == 0) {
+    return EventLoopMode::IO_URING;
+  }
+  return EventLoopMode::PER_THREAD_EDGE;
+}
+
+// DA_OUTPUT=mmap selects the preallocated, memory-mapped output file.
+OutputMode Process::output_mode() {
+  const char *mode = std::getenv("DA_OUTPUT");
+  if (mode != nullptr && std::strcmp(mode, "mmap") == 0) {
+    return OutputMode::MAPPED;
+  }
+  return OutputMode::BUFFERED;
+}
+
+static const char *event_loop_mode_name(EventLoopMode mode) {
+  switch (mode) {
+    case EventLoopMode::SHARED_ONESHOT:
+      return "Shared oneshot";
+    case EventLoopMode::IO_URING:
+      return "io_uring";
+    case EventLoopMode::PER_THREAD_EDGE:
+    default:
+      return "Per-thread edge";
+  }
+}
+
+void Process::print_stats() {
+  BufferPoolStats blocks = _log.block_stats();
+  if (blocks.takes > 0) {
+    std::cerr << "Output blocks: " << blocks.takes << " taken, " << blocks.heap_allocs
+              << " from the heap, " << blocks.refills << " refills" << std::endl;
+  }
+
+  RecvStats stats = _pl->recv_stats();
+  if (stats.datagrams == 0) {
+    return;
+  }
+  EventLoopStats loop_stats = _event_loop.stats();
+  if (stats.syscalls > 0) {
+    std::cerr << "Received " << stats.datagrams << " datagrams in "
+              << stats.syscalls << " recvmmsg calls ("
+              << static_cast<double>(stats.datagrams) / static_cast<double>(stats.syscalls)
+              << " per call)" << std::endl;
+  } else {
+    std::cerr << "Received " << stats.datagrams << " datagrams in "
+              << loop_stats.waits << " io_uring_enter calls ("
+              << static_cast<double>(stats.datagrams) / static_cast<double>(std::max<uint64_t>(loop_stats.waits, 1))
+              << " per call)" << std::endl;
+  }
+
+  uint64_t syscalls = stats.syscalls + loop_stats.waits + loop_stats.rearms;
+  size_t delivered = _n_delivered.load();
+  if (_fifo != nullptr) {
+    delivered = _fifo->delivered();
+  } else if (_lattice != nullptr) {
+    delivered = _lattice->decided();
+  }
+  std::cerr << event_loop_mode_name(_event_loop.mode())
+            << " event loop: " << loop_stats.waits << " waits, " << loop_stats.rearms
+            << " epoll_ctl rearms";
+  if (delivered > 0) {
+    std::cerr << ", " << static_cast<double>(syscalls) / static_cast<double>(delivered)
+              << " receive syscalls per delivered message";
+  }
+  std::cerr << std::endl;
+}
+
+// Perfect links: the receiver gets every other process' messages. FIFO
+// broadcast: every process delivers everyone's, its own included. Lattice
+// agreement: one decision per shot.
+size_t Process::expected_messages(const Config& cfg, size_t n_processes) {
+  if (cfg.kind() == ConfigKind::LATTICE_AGREEMENT) {
+    return cfg.n_proposals();
+  }
+  if (cfg.kind() == ConfigKind::FIFO_BROADCAST) {
+    return static_cast<size_t>(cfg.num_messages()) * n_processes;
+  }
+  return static_cast<size_t>(cfg.num_messages()) * (n_processes - 1);
 }
 
 uint64_t Process::pid() const {
@@ -50,20 +192,36 @@ uint64_t Process::pid() const {
 }
 
 void Process::run(const Config& cfg) {
-  if (cfg.receiver_proc() != _pid) {
+  if (_fifo != nullptr) {
+    _fifo->run();
+  } else if (_lattice != nullptr) {
+    _lattice->run();
+  } else if (cfg.receiver_proc() != _pid) {
     run_sender(cfg);
   } else {
     run_receiver(cfg);
   }
 }
 
+// Links stop first: a sender logs and transmits under the same lock stop()
+// takes, so nothing goes out whose broadcast line the sealed log would drop.
+// With the output durable nothing is left to lose, the alarm bounds how long
+// joining the threads may take. Later calls do nothing.
 void Process::stop() {
-  {
-    std::lock_guard<std::mutex> lock(_outfile_mutex);
-    std::cerr << "Flushing output file" << std::endl;
-    _outfile.flush();
+  if (_stopping.exchange(true)) {
+    return;
+  }
+  _stop_requested_at = std::chrono::steady_clock::now();
+  if (_fifo != nullptr) {
+    _fifo->stop();
+  }
+  if (_lattice != nullptr) {
+    _lattice->stop();
   }
   _pl->stop();
+  std::cerr << "Flushing output file" << std::endl;
+  _log.seal();
+  alarm(stop_deadline_s);
   _event_loop.stop();
   _stop.store(true);
   _stop_cv.notify_all();
@@ -87,7 +245,7 @@ void Process::run_sender(const Config& cfg) {
   }
   assert(found);
 
-  _pl->send(cfg.num_messages(), cfg.receiver_proc(), _outfile, _outfile_mutex);
+  _pl->send(cfg.num_messages(), cfg.receiver_proc(), _log);
 
   // Wait until stop is called.
   {
@@ -104,22 +262,20 @@ void Process::run_receiver(const Config& cfg) {
   _event_loop.run();
 }
 
-void Process::sender_deliver_callback(const Packet& pkt) {
+void Process::sender_deliver_callback(const PacketView& pkt) {
   (void) pkt;
 }
 
 // Specialize this function for message data types.
-void Process::receiver_deliver_callback(const Packet& pkt) {
-  std::lock_guard<std::mutex> lock(_outfile_mutex);
-  for (size_t i = 0; i < pkt.data().size(); i += sizeof(uint32_t)) {
-    uint32_t seq_id;
-    std::memcpy(&seq_id, pkt.data().data() + i, sizeof(uint32_t));
-    _outfile << "d " << pkt.pid() << " " << seq_id << "\n";
-    assert(_n_messages > 0);
-    --_n_messages;
-    if (_n_messages == 0) {
-      std::cerr << "Process " << _pid << " received all messages!" << std::endl;
-    }
+void Process::receiver_deliver_callback(const PacketView& pkt) {
+  size_t n = 0;
+  decode_messages(pkt.data(), pkt.data_size(), pkt.flags(), [this, &pkt, &n](uint32_t first, uint32_t count) {
+    _log.append_lines('d', pkt.pid(), first, count);
+    n += count;
+  });
+  size_t delivered = _n_delivered.fetch_add(n) + n;
+  assert(delivered <= _n_messages);
+  if (n > 0 && delivered == _n_messages) {
+    std::cerr << "Process " << _pid << " received all messages!" << std::endl;
   }
-//  _outfile.flush();
 }
@@ -2,34 +2,75 @@
 #include <iostream>
 #include "read_event_handler.hpp"
 
-ReadEventHandler::ReadEventHandler(UDPSocket *socket, DeliverCallback process_pkt_callback) :
+ReadEventHandler::ReadEventHandler(UDPSocket *socket, PacketCallback process_pkt_callback,
+                                   BatchEndCallback batch_end_callback, size_t batch_size) :
                                    _socket(socket),
-                                   _process_pkt_callback(std::move(process_pkt_callback)) {}
+                                   _process_pkt_callback(std::move(process_pkt_callback)),
+                                   _batch_end_callback(std::move(batch_end_callback)),
+                                   _batch(batch_size) {}
 
 void ReadEventHandler::handle_read_event(uint32_t events) {
   if (events & EPOLLIN) {
     // Data is available to read.
-    std::vector<uint8_t> buffer(RECV_BUF_SIZE, 0);
+    std::lock_guard<std::mutex> lock(_batch_mutex);
     while (true) {
-      buffer.resize(RECV_BUF_SIZE);
-      ssize_t nrecv = _socket->recv_buf(buffer);
+      int nrecv = _socket->recv_batch(_batch);
       if (nrecv == -1) {
         if (errno == EWOULDBLOCK || errno == ECONNREFUSED) {
           break;
         }
-        std::string err_msg = "recv() failed. Error message: ";
+        std::string err_msg = "recvmmsg() failed. Error message: ";
         err_msg += strerror(errno);
         perror(err_msg.c_str());
         exit(EXIT_FAILURE);
       }
-      if (nrecv == 0) {
-        continue;
+      _recv_syscalls.fetch_add(1, std::memory_order_relaxed);
+
+      // Process the received batch.
+      auto n = static_cast<size_t>(nrecv);
+      for (size_t i = 0; i < n; i++) {
+        handle_datagram(_batch.data(i), _batch.len(i), _batch.truncated(i), _batch.source(i));
+      }
+      end_batch();
+
+      // A short batch means the socket has been drained.
+      if (n < _batch.size()) {
+        break;
       }
-      // Process the received data.
-      Packet pkt;
-      buffer.resize(static_cast<size_t>(nrecv));
-      pkt.deserialize(buffer);
-      _process_pkt_callback(pkt);
     }
   }
-}
\ No newline at end of file
+}
+
+void ReadEventHandler::handle_datagram(const uint8_t *data, size_t len, bool truncated,
+                                       const struct sockaddr_in& source) {
+  _recv_datagrams.fetch_add(1, std::memory_order_relaxed);
+  PacketView pkt;
+  if (truncated || !pkt.decode(data, len)) {
+    // Drop truncated or malformed datagrams.
+    return;
+  }
+  _process_pkt_callback(pkt, source);
+
+  // A coalesced datagram carries more frames after the first one. Frames up
+  // to a malformed one are kept, the rest of the datagram is dropped.
+  if (pkt.wire_format() < WireFormat::COALESCED) {
+    return;
+  }
+  for (size_t offset = pkt.size(); offset < len; offset += pkt.size()) {
+    if (!pkt.decode(data + offset, len - offset) || pkt.wire_format() < WireFormat::COALESCED) {
+      return;
+    }
+    _process_pkt_callback(pkt, source);
+  }
+}
+
+void ReadEventHandler::end_batch() {
+  if (_batch_end_callback) {
+    _batch_end_callback();
+  }
+}
+
+RecvStats ReadEventHandler::stats() const {
+  return {_recv_syscalls.load(std::memory_order_relaxed),
+          _recv_datagrams.load(std::memory_order_relaxed)};
+}
@@ -0,0 +1,31 @@
+#include <algorithm>
+#include "rtt_estimator.hpp"
+
+void RttEstimator::sample(duration rtt) {
+  if (!_has_sample) {
+    _srtt = rtt;
+    _rttvar = rtt / 2;
+    _has_sample = true;
+  } else {
+    duration err = _srtt > rtt ? _srtt - rtt : rtt - _srtt;
+    _rttvar = (3 * _rttvar + err) / 4;
+    _srtt = (7 * _srtt + rtt) / 8;
+  }
+  _rto = std::clamp(_srtt + 4 * _rttvar, MIN_RTO, MAX_RTO);
+}
+
+RttEstimator::duration RttEstimator::rto() const {
+  return _rto;
+}
+
+RttEstimator::duration RttEstimator::rto(uint32_t transmissions) const {
+  duration rto = _rto;
+  for (uint32_t i = 1; i < transmissions && rto < MAX_RTO; i++) {
+    rto *= 2;
+  }
+  return std::min(rto, MAX_RTO);
+}
+
+RttEstimator::duration RttEstimator::srtt() const {
+  return _srtt;
+}
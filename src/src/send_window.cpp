@@ -0,0 +1,134 @@
+#include <cassert>
+#include "send_window.hpp"
+
+static uint32_t round_up_pow2(uint32_t value) {
+  uint32_t pow2 = 1;
+  while (pow2 < value) {
+    pow2 <<= 1;
+  }
+  return pow2;
+}
+
+// Slots are indexed with a mask, the slab is rounded up to a power of two
+// but never holds more than `capacity` unretired packets.
+SendWindow::SendWindow(uint32_t capacity, size_t max_data_size, uint32_t first_seq_id)
+    : _capacity(capacity), _mask(round_up_pow2(capacity) - 1), _max_data_size(max_data_size),
+      _slots(_mask + 1, SendSlot{SlotState::FREE, 0, 0, 0, 0, {}}),
+      _slab((_mask + 1) * max_data_size), _base(first_seq_id), _next(first_seq_id),
+      _outstanding(0) {}
+
+SendSlot& SendWindow::slot(uint32_t seq_id) {
+  return _slots[seq_id & _mask];
+}
+
+const SendSlot& SendWindow::slot(uint32_t seq_id) const {
+  return _slots[seq_id & _mask];
+}
+
+// Free the acknowledged prefix of the window.
+void SendWindow::retire() {
+  while (_base != _next && slot(_base).state == SlotState::ACKED) {
+    slot(_base).state = SlotState::FREE;
+    _base++;
+  }
+}
+
+bool SendWindow::full() const {
+  return _next - _base >= _capacity;
+}
+
+bool SendWindow::empty() const {
+  return _base == _next;
+}
+
+uint32_t SendWindow::base() const {
+  return _base;
+}
+
+uint32_t SendWindow::next() const {
+  return _next;
+}
+
+uint32_t SendWindow::outstanding() const {
+  return _outstanding;
+}
+
+// Claim the slot for the next sequence id and return its payload buffer.
+uint8_t *SendWindow::push(uint32_t data_size, uint8_t flags) {
+  assert(!full() && data_size <= _max_data_size);
+  SendSlot& s = slot(_next);
+  s.state = SlotState::IN_FLIGHT;
+  s.flags = flags;
+  s.seq_id = _next;
+  s.data_size = data_size;
+  s.transmissions = 0;
+  s.sent_at = {};
+  _next++;
+  _outstanding++;
+  return _slab.data() + (s.seq_id & _mask) * _max_data_size;
+}
+
+void SendWindow::record(const SendSlot& s, AckSample& sample) const {
+  sample.acked++;
+  if (s.transmissions == 1 && (!sample.has_rtt_sample || s.sent_at > sample.latest_sent_at)) {
+    sample.has_rtt_sample = true;
+    sample.latest_sent_at = s.sent_at;
+  }
+}
+
+// Returns true if seq_id was in flight.
+bool SendWindow::ack(uint32_t seq_id, AckSample& sample) {
+  if (!in_flight(seq_id)) {
+    return false;
+  }
+  SendSlot& s = slot(seq_id);
+  record(s, sample);
+  s.state = SlotState::ACKED;
+  _outstanding--;
+  retire();
+  return true;
+}
+
+// Acknowledge every sequence id strictly below seq_id.
+void SendWindow::ack_below(uint32_t seq_id, AckSample& sample) {
+  while (_base != _next && _base < seq_id) {
+    SendSlot& s = slot(_base);
+    if (s.state == SlotState::IN_FLIGHT) {
+      record(s, sample);
+      _outstanding--;
+    }
+    s.state = SlotState::FREE;
+    _base++;
+  }
+  retire();
+}
+
+void SendWindow::mark_sent(uint32_t seq_id, std::chrono::steady_clock::time_point now) {
+  SendSlot& s = slot(seq_id);
+  s.sent_at = now;
+  s.transmissions++;
+}
+
+bool SendWindow::in_flight(uint32_t seq_id) const {
+  return seq_id >= _base && seq_id < _next && slot(seq_id).state == SlotState::IN_FLIGHT;
+}
+
+const uint8_t *SendWindow::data(uint32_t seq_id) const {
+  return _slab.data() + (seq_id & _mask) * _max_data_size;
+}
+
+uint32_t SendWindow::data_size(uint32_t seq_id) const {
+  return slot(seq_id).data_size;
+}
+
+uint8_t SendWindow::flags(uint32_t seq_id) const {
+  return slot(seq_id).flags;
+}
+
+uint32_t SendWindow::transmissions(uint32_t seq_id) const {
+  return slot(seq_id).transmissions;
+}
+
+std::chrono::steady_clock::time_point SendWindow::sent_at(uint32_t seq_id) const {
+  return slot(seq_id).sent_at;
+}
@@ -3,31 +3,55 @@
 #include <cstring>
 #include <cstdio>
 #include <utility>
+#include <algorithm>
 #include <cassert>
 #include "stubborn_link.hpp"
+#include "payload_codec.hpp"
 
-StubbornLink::StubbornLink(uint64_t pid, in_addr_t addr, uint16_t port,
-                           in_addr_t paddr, uint16_t pport,
-                           bool sender, EventLoop& event_loop, DeliverCallback deliver_cb) :
-                           _socket(addr, port), _sender(sender),
-                           _deliver_cb(std::move(deliver_cb)),
-                           _pid(pid), _stop(false) {
+StubbornLink::StubbornLink(uint64_t pid, UDPSocket& socket, in_addr_t paddr, uint16_t pport,
+                           bool sender, uint32_t advertised_window, SendSignal &send_signal,
+                           AcceptCallback accept_cb, PacketSource source,
+                           AckVectorSource ack_vector_source, AckVectorCallback ack_vector_cb,
+                           size_t max_data_size) :
+                           _socket(socket), _sender(sender), _max_data_size(max_data_size),
+                           _send_window(window_capacity(max_data_size), max_data_size, 1),
+                           _send_signal(send_signal),
+                           _send_batch(window_capacity(max_data_size),
+                                       window_capacity(max_data_size) * (HEADER_SIZE + max_data_size)),
+                           _accept_cb(std::move(accept_cb)), _source(std::move(source)),
+                           _ack_vector_source(std::move(ack_vector_source)),
+                           _ack_vector_cb(std::move(ack_vector_cb)),
+                           _pid(pid), _stop(false),
+                           _advertised_window(std::min<uint32_t>(advertised_window, UINT16_MAX)) {
+  _peer_addr.sin_family = AF_INET;
+  _peer_addr.sin_port = pport;
+  _peer_addr.sin_addr.s_addr = paddr;
+  assert(max_data_size >= MAX_DATA_SIZE && max_data_size <= MAX_LINK_DATA_SIZE);
+}
 
-  struct sockaddr_in peer_addr{};
-  peer_addr.sin_family = AF_INET;
-  peer_addr.sin_port = pport;
-  peer_addr.sin_addr.s_addr = paddr;
-  _socket.conn(peer_addr);
+uint32_t StubbornLink::window_capacity(size_t max_data_size) {
+  return static_cast<uint32_t>(std::max<size_t>(max_window_size * MAX_DATA_SIZE / max_data_size, 1));
+}
 
-  _read_event_handler = new ReadEventHandler(&_socket,
-                                             [this](const Packet& pkt) { this->process_packet(pkt); });
-  _read_event_data.fd = _socket.infd();
-  _read_event_data.handler_obj = _read_event_handler;
+void SendSignal::raise() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _raised = true;
+  }
+  _cv.notify_one();
+}
+
+void SendSignal::wait_until(std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait_until(lock, deadline, [this] { return _raised; });
+  _raised = false;
+}
 
-  event_loop.add(EPOLLIN, &_read_event_data);
+bool StubbornLink::is_peer(const struct sockaddr_in& addr) const {
+  return addr.sin_addr.s_addr == _peer_addr.sin_addr.s_addr && addr.sin_port == _peer_addr.sin_port;
 }
 
-void StubbornLink::process_packet(const Packet& pkt) {
+void StubbornLink::process_packet(const PacketView& pkt) {
   switch (pkt.packet_type()) {
     case PacketType::SYN:
     {
@@ -38,19 +62,26 @@ void StubbornLink::process_packet(const Packet& pkt) {
         _syn_received.store(true);
       }
       _syn_received_cv.notify_all();
-      // Send a SYN_ACK.
+      _send_signal.raise();
+      // Send a SYN_ACK carrying the wire format we picked from the SYN.
       assert(pkt.seq_id() == 0);
-      Packet ack_pkt(_pid, PacketType::ACK, pkt.seq_id());
-      _socket.send_buf(ack_pkt.serialize());
+      WireFormat format = negotiate_wire_format(pkt);
+      _wire_format.store(format);
+      auto version = static_cast<uint8_t>(format);
+      send_control_packet({_pid, PacketType::ACK, pkt.seq_id(), sizeof(version)}, &version);
       break;
     }
     case PacketType::ACK:
     {
       if (pkt.seq_id() == 0) {
+        _wire_format.store(negotiate_wire_format(pkt));
         _syn_ack_received.store(true);
+        _send_signal.raise();
       } else {
         std::lock_guard<std::mutex> lock(_unacked_mutex);
-        unacked_packets.erase(pkt);
+        AckSample sample;
+        _send_window.ack(pkt.seq_id(), sample);
+        on_acked(sample);
       }
       break;
     }
@@ -59,11 +90,33 @@ void StubbornLink::process_packet(const Packet& pkt) {
       // It is a data packet.
 
       // Deliver the data packet.
-      _deliver_cb(pkt);
+      if (!_accept_cb(pkt)) {
+        break;
+      }
 
-      // Send an ACK.
-      Packet ack_pkt(pkt.pid(), PacketType::ACK, pkt.seq_id());
-      _socket.send_buf(ack_pkt.serialize());
+      // Always recorded, the link may switch to SACKs once the SYN_ACK
+      // arrives and the cumulative ACK must then cover earlier packets too.
+      _ack_window.mark(pkt.seq_id());
+      WireFormat format = _wire_format.load(std::memory_order_relaxed);
+      if (format == WireFormat::LEGACY) {
+        // Send an ACK.
+        send_control_packet({_pid, PacketType::ACK, pkt.seq_id(), 0}, nullptr, format);
+      } else {
+        // Acknowledged together with the rest of the batch by flush_sack().
+        _sack_pending = true;
+      }
+      break;
+    }
+    case PacketType::SACK:
+    {
+      process_sack(pkt);
+      break;
+    }
+    case PacketType::ACK_VECTOR:
+    {
+      if (_ack_vector_cb) {
+        _ack_vector_cb(pkt);
+      }
       break;
     }
     default:
@@ -72,44 +125,267 @@ void StubbornLink::process_packet(const Packet& pkt) {
   }
 }
 
-void StubbornLink::store_and_output_messages(uint32_t n_messages,
-                                             std::ofstream &outfile,
-                                             std::mutex &outfile_mutex) {
+// Retire everything below the cumulative ACK at once, then the out-of-order
+// receipts flagged in the bitmap.
+void StubbornLink::process_sack(const PacketView& pkt) {
+  if (pkt.data_size() < SACK_RWND_SIZE) {
+    return;
+  }
+  auto rwnd = static_cast<uint32_t>(pkt.data()[0] | pkt.data()[1] << 8);
+  std::lock_guard<std::mutex> lock(_unacked_mutex);
+  _cwnd.set_receiver_window(rwnd);
+  AckSample sample;
+  _send_window.ack_below(pkt.seq_id(), sample);
+  for_each_sacked(pkt.seq_id(), pkt.data() + SACK_RWND_SIZE, pkt.data_size() - SACK_RWND_SIZE,
+                  [this, &sample](uint32_t seq_id) {
+    _send_window.ack(seq_id, sample);
+  });
+  on_acked(sample);
+}
+
+// Feed the RTT estimator and wake up the sender, which may now have room in
+// its window. Must hold _unacked_mutex.
+void StubbornLink::on_acked(const AckSample& sample) {
+  if (sample.acked == 0) {
+    return;
+  }
+  if (sample.has_rtt_sample) {
+    auto rtt = std::chrono::steady_clock::now() - sample.latest_sent_at;
+    _rtt.sample(std::chrono::duration_cast<RttEstimator::duration>(rtt));
+  }
+  _cwnd.on_ack(sample.acked);
+  _send_signal.raise();
+}
+
+bool StubbornLink::sack_pending() const {
+  return _sack_pending;
+}
+
+void StubbornLink::flush_sack() {
+  if (!_sack_pending) {
+    return;
+  }
+  _sack_pending = false;
+  uint8_t payload[SACK_RWND_SIZE + MAX_SACK_BITMAP_SIZE];
+  payload[0] = static_cast<uint8_t>(_advertised_window);
+  payload[1] = static_cast<uint8_t>(_advertised_window >> 8);
+  size_t size = SACK_RWND_SIZE +
+                _ack_window.encode_bitmap(payload + SACK_RWND_SIZE, MAX_SACK_BITMAP_SIZE);
+  send_control_packet({_pid, PacketType::SACK, _ack_window.cumulative(), static_cast<uint32_t>(size)},
+                      payload, _wire_format.load(std::memory_order_relaxed));
+}
+
+// Generate DATA packets for the next messages until the window is full and
+// log their "b" lines, or take them from the source, which logs on its own.
+// Must hold _unacked_mutex.
+void StubbornLink::fill_window(LogWriter &log) {
+  // Peers that understand payload flags get the ids as a run.
+  WireFormat format = _wire_format.load(std::memory_order_relaxed);
+  if (_source) {
+    while (!_send_window.full() && _send_window.outstanding() < _cwnd.window()) {
+      uint8_t payload[MAX_LINK_DATA_SIZE];
+      uint8_t flags = 0;
+      size_t size = _source(format, payload, flags);
+      if (size == 0) {
+        break;
+      }
+      assert(size <= _max_data_size);
+      std::memcpy(_send_window.push(static_cast<uint32_t>(size), flags), payload, size);
+    }
+    return;
+  }
   // Send 8 messages at a single packet.
-  std::vector<std::string> output_buffers;
-  {
-    std::lock_guard<std::mutex> lock(_unacked_mutex);
-    uint32_t current_seq_id = 1;
-    for (uint32_t i = 0; i < n_messages; i += 8) {
-      uint32_t packet_size = std::min(8U, n_messages - i);
-      std::vector<uint8_t> data(packet_size * sizeof(uint32_t));
-      for (uint32_t j = 0; j < packet_size; j++) {
-        std::memcpy(data.data() + j * sizeof(uint32_t), &current_seq_id,
-                    sizeof(uint32_t));
-        output_buffers.push_back("b " + std::to_string(current_seq_id) + "\n");
-        current_seq_id++;
+  while (!_send_window.full() && _send_window.outstanding() < _cwnd.window() &&
+         _next_message <= _n_messages) {
+    auto packet_size = static_cast<uint32_t>(
+        std::min<uint64_t>(MESSAGES_PER_PACKET, _n_messages - _next_message + 1));
+    // Packet sequence ids follow from the message ids: packet k carries
+    // messages 8(k-1)+1 .. 8k.
+    assert(_send_window.next() == (_next_message - 1) / MESSAGES_PER_PACKET + 1);
+    uint32_t ids[MESSAGES_PER_PACKET];
+    for (uint32_t j = 0; j < packet_size; j++) {
+      ids[j] = static_cast<uint32_t>(_next_message + j);
+    }
+    uint8_t payload[MAX_DATA_SIZE];
+    uint8_t flags;
+    size_t size = encode_messages(ids, packet_size, format, payload, flags);
+    std::memcpy(_send_window.push(static_cast<uint32_t>(size), flags), payload, size);
+    log.append_lines('b', ids[0], packet_size);
+
+    _next_message += packet_size;
+  }
+}
+
+// Serialize the packets that have never been sent, or whose retransmission
+// timeout expired, into the send arena. With the COALESCED format consecutive
+// packets share a datagram up to MAX_DATAGRAM_SIZE. Returns when the earliest packet left
+// out will expire. Must hold _unacked_mutex.
+std::chrono::steady_clock::time_point StubbornLink::fill_send_batch() {
+  auto now = std::chrono::steady_clock::now();
+  auto next_deadline = now + _rtt.rto();
+  WireFormat format = _wire_format.load(std::memory_order_relaxed);
+  // Bytes in the datagram packets are being coalesced into, 0 if there is
+  // none.
+  size_t datagram_size = 0;
+  for (uint32_t seq_id = _send_window.base(); seq_id != _send_window.next(); seq_id++) {
+    if (!_send_window.in_flight(seq_id)) {
+      continue;
+    }
+    uint32_t transmissions = _send_window.transmissions(seq_id);
+    bool retransmission = transmissions > 0;
+    if (retransmission) {
+      auto deadline = _send_window.sent_at(seq_id) + _rtt.rto(transmissions);
+      if (deadline > now) {
+        next_deadline = std::min(next_deadline, deadline);
+        continue;
+      }
+    }
+    PacketHeader header{_pid, PacketType::DATA, seq_id, _send_window.data_size(seq_id),
+                        _send_window.flags(seq_id)};
+    size_t len = 0;
+    if (datagram_size > 0) {
+      // Appended to the open datagram while it stays within the MTU.
+      len = PacketView::encode(_send_batch.tail(),
+                               std::min(_send_batch.available(), MAX_DATAGRAM_SIZE - datagram_size),
+                               header, _send_window.data(seq_id), format);
+      if (len > 0) {
+        _send_batch.extend(len);
+        datagram_size += len;
+      }
+    }
+    if (len == 0) {
+      if (_send_batch.full()) {
+        break;
+      }
+      len = PacketView::encode(_send_batch.tail(), _send_batch.available(), header,
+                               _send_window.data(seq_id), format);
+      if (len == 0) {
+        break;
       }
+      _send_batch.commit(len, &_peer_addr);
+      _datagrams.fetch_add(1, std::memory_order_relaxed);
+      datagram_size = format >= WireFormat::COALESCED ? len : 0;
+    }
+    _send_window.mark_sent(seq_id, now);
+    _transmissions.fetch_add(1, std::memory_order_relaxed);
+    if (retransmission) {
+      _retransmissions.fetch_add(1, std::memory_order_relaxed);
+      _cwnd.on_loss(seq_id, _send_window.next());
+    }
+  }
+  _open_datagram = datagram_size;
+  return next_deadline;
+}
 
-      Packet p(_pid, PacketType::DATA, (i / 8) + 1, data);
-      unacked_packets.insert(p);
+// Lets an ACK_VECTOR ride in the datagram the batch ends with, if there is
+// room left. Must hold _unacked_mutex.
+bool StubbornLink::append_ack_vector() {
+  WireFormat format = _wire_format.load(std::memory_order_relaxed);
+  if (!_ack_vector_source || _open_datagram == 0 || format < WireFormat::ACK_VECTORS) {
+    return false;
+  }
+  size_t capacity = std::min(_send_batch.available(), MAX_DATAGRAM_SIZE - _open_datagram);
+  if (capacity <= COMPACT_MAX_HEADER_SIZE) {
+    return false;
+  }
+  uint8_t payload[MAX_DATAGRAM_SIZE];
+  size_t size = _ack_vector_source(payload, capacity - COMPACT_MAX_HEADER_SIZE, false);
+  if (size == 0) {
+    return false;
+  }
+  size_t len = PacketView::encode(_send_batch.tail(), capacity,
+                                  {_pid, PacketType::ACK_VECTOR, 0, static_cast<uint32_t>(size)},
+                                  payload, format);
+  assert(len > 0);
+  _send_batch.extend(len);
+  _open_datagram += len;
+  return true;
+}
+
+// An ACK_VECTOR that found no DATA to ride with. Lost ones are not resent,
+// the source sends the next one when it sees fit.
+void StubbornLink::send_ack_vector() {
+  WireFormat format = _wire_format.load(std::memory_order_relaxed);
+  if (!_ack_vector_source || format < WireFormat::ACK_VECTORS) {
+    return;
+  }
+  uint8_t payload[MAX_DATAGRAM_SIZE - COMPACT_MAX_HEADER_SIZE];
+  size_t size = _ack_vector_source(payload, sizeof(payload), true);
+  if (size == 0) {
+    return;
+  }
+  uint8_t datagram[MAX_DATAGRAM_SIZE];
+  size_t len = PacketView::encode(datagram, sizeof(datagram),
+                                  {_pid, PacketType::ACK_VECTOR, 0, static_cast<uint32_t>(size)},
+                                  payload, format);
+  assert(len > 0);
+  if (_socket.send_to(datagram, len, _peer_addr) >= 0) {
+    _control_datagrams.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool StubbornLink::connected() const {
+  return _syn_received.load() || _syn_ack_received.load();
+}
+
+SendStep StubbornLink::send_step(LogWriter &log, std::chrono::steady_clock::time_point &next_deadline) {
+  if (!connected()) {
+    if (_stop.load()) {
+      return SendStep::STOPPED;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now >= _next_syn) {
+      send_syn_packet();
+      _next_syn = now + _syn_interval;
+      _syn_interval = std::min(2 * _syn_interval, MAX_SYN_INTERVAL);
     }
+    next_deadline = std::min(next_deadline, _next_syn);
+    return SendStep::CONNECTING;
   }
 
-  {
-    std::lock_guard<std::mutex> lock(outfile_mutex);
-    for (const auto& buffer : output_buffers) {
-      outfile << buffer;
+  // Only refill once the previous window has been flushed completely, a
+  // partial send resumes from the first datagram that did not go out.
+  if (_send_batch.pending() == 0) {
+    // Lock, top up the window and serialize it straight into the send arena.
+    std::unique_lock<std::mutex> lock(_unacked_mutex);
+    // stop() sets the flag under this lock: once it has returned, no more
+    // messages are logged as broadcast and then sent.
+    if (_stop.load()) {
+      return SendStep::STOPPED;
+    }
+    fill_window(log);
+    if (_send_window.empty()) {
+      lock.unlock();
+      send_ack_vector();
+      return SendStep::IDLE;
+    }
+    _next_deadline = fill_send_batch();
+    if (!append_ack_vector() && _send_batch.pending() == 0) {
+      lock.unlock();
+      send_ack_vector();
+    }
+  }
+
+  while (_send_batch.pending() > 0) {
+    int nsent = _socket.send_batch(_send_batch);
+    if (nsent == -1) {
+      if (errno == ECONNREFUSED || errno == EWOULDBLOCK) {
+        return SendStep::BLOCKED;
+      }
+      perror("sendmmsg failed");
+      exit(EXIT_FAILURE);
     }
-    outfile.flush();
   }
+  next_deadline = std::min(next_deadline, _next_deadline);
+  return SendStep::SENT;
 }
 
-// Sliding window approach.
-void StubbornLink::send_unacked_messages() {
+// Sliding window approach. Every packet has its own retransmission timer
+// derived from the link's RTT estimate, only expired packets are resent.
+void StubbornLink::send_unacked_messages(LogWriter &log) {
   const int initial_interval_ms = 50;
   const int max_interval_ms = 1000;
   int timeout_interval_ms = initial_interval_ms;
-  const uint32_t sliding_window_size = 300;  // Sliding window size
 
   // Wait for the receiver to start (SYN received).
   {
@@ -118,67 +394,95 @@ void StubbornLink::send_unacked_messages() {
   }
 
   // Main retransmission loop
-  while (!_stop.load()) {
-    std::vector<Packet> packets_to_send;
+  while (true) {
+    auto next_deadline = std::chrono::steady_clock::time_point::max();
+    SendStep step = send_step(log, next_deadline);
+    if (step == SendStep::STOPPED) {
+      break;
+    }
+    if (step == SendStep::IDLE) {
+      _stop.store(true);
+      std::cerr << "No more unacknowledged packets. Exiting..." << std::endl;
+      break;
+    }
+    if (step == SendStep::BLOCKED) {
+      // If an error occurs, wait for the timeout before retrying
+      timeout_interval_ms = std::min(backoff_interval(timeout_interval_ms), max_interval_ms);
+      std::this_thread::sleep_for(std::chrono::milliseconds(timeout_interval_ms));
+      continue;
+    }
+    timeout_interval_ms = initial_interval_ms;
 
-    {
-      // Lock and populate packets_to_send with the sliding window size
-      std::unique_lock<std::mutex> lock(_unacked_mutex);
-      if (unacked_packets.empty()) {
-        _stop.store(true);
-        std::cerr << "No more unacknowledged packets. Exiting..." << std::endl;
-        continue;  // Exit if there are no unacknowledged packets
-      }
+    // Sleep until a timer expires or an ACK makes room in the window.
+    _send_signal.wait_until(next_deadline);
+  }
 
-      auto it = unacked_packets.begin();
-      for (size_t i = 0; i < sliding_window_size && it != unacked_packets.end(); ++i, ++it) {
-        packets_to_send.push_back(*it);
-      }
-    }
+  SendStats stats = send_stats();
+  std::cerr << "Exiting send_unacked_messages... RTO "
+            << static_cast<double>(stats.rto.count()) / 1000.0 << " ms, cwnd "
+            << stats.cwnd << ", retransmitted "
+            << stats.retransmissions << " of " << stats.transmissions << " transmissions in "
+            << stats.datagrams << " datagrams" << std::endl;
+}
 
-    // Send packets in the current sliding window
-    for (const auto& pkt : packets_to_send) {
-      auto pkt_serialized = pkt.serialize();
-
-      ssize_t nsent = _socket.send_buf(pkt_serialized);
-      if (nsent == -1) {
-        if (errno == ECONNREFUSED || errno == EWOULDBLOCK) {
-          // If an error occurs, wait for the timeout before retrying
-          timeout_interval_ms = std::min(backoff_interval(timeout_interval_ms), max_interval_ms);
-//          std::cerr << "Current interval ms increased to " << timeout_interval_ms << std::endl;
-        } else {
-          perror("send failed");
-          exit(EXIT_FAILURE);
-        }
-      } else {
-        timeout_interval_ms = initial_interval_ms;
-      }
-    }
+SendStats StubbornLink::send_stats() {
+  std::lock_guard<std::mutex> lock(_unacked_mutex);
+  return {_rtt.rto(), _cwnd.cwnd(), _transmissions.load(std::memory_order_relaxed),
+          _retransmissions.load(std::memory_order_relaxed),
+          _datagrams.load(std::memory_order_relaxed),
+          _control_datagrams.load(std::memory_order_relaxed)};
+}
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_interval_ms));
+// Control packets are encoded on the stack and sent right away.
+void StubbornLink::send_control_packet(const PacketHeader& header, const uint8_t *data,
+                                       WireFormat format) {
+  uint8_t buffer[HEADER_SIZE + SACK_RWND_SIZE + MAX_SACK_BITMAP_SIZE];
+  size_t len = PacketView::encode(buffer, sizeof(buffer), header, data, format);
+  assert(len > 0);
+  if (_socket.send_to(buffer, len, _peer_addr) >= 0) {
+    _control_datagrams.fetch_add(1, std::memory_order_relaxed);
   }
+}
 
-  std::cerr << "Exiting send_unacked_messages..." << std::endl;
+// SYN and SYN_ACK carry the highest wire format their sender understands as a
+// one-byte payload. Peers that predate the negotiation send an empty payload
+// and keep the legacy format.
+WireFormat StubbornLink::negotiate_wire_format(const PacketView& pkt) {
+  if (pkt.data_size() < sizeof(uint8_t)) {
+    return WireFormat::LEGACY;
+  }
+  uint8_t version = std::min(pkt.data()[0], static_cast<uint8_t>(LATEST_WIRE_FORMAT));
+  if (version < static_cast<uint8_t>(WireFormat::LEGACY)) {
+    return WireFormat::LEGACY;
+  }
+  return static_cast<WireFormat>(version);
 }
 
-void StubbornLink::send(uint32_t n_messages, std::ofstream &outfile, std::mutex &outfile_mutex) {
-  store_and_output_messages(n_messages, outfile, outfile_mutex);
+void StubbornLink::send(uint32_t n_messages, LogWriter &log) {
+  {
+    std::lock_guard<std::mutex> lock(_unacked_mutex);
+    _n_messages = n_messages;
+  }
 
-  send_unacked_messages();
+  send_unacked_messages(log);
 }
 
 bool StubbornLink::send_syn_packet() {
   if (_syn_ack_received.load()) {
     return false;
   }
-  Packet syn_pkt(_pid, PacketType::SYN, 0);
-  _socket.send_buf(syn_pkt.serialize());
+  auto version = static_cast<uint8_t>(LATEST_WIRE_FORMAT);
+  send_control_packet({_pid, PacketType::SYN, 0, sizeof(version)}, &version);
 
   return true;
 }
 
 void StubbornLink::stop() {
-  _stop.store(true);
+  {
+    std::lock_guard<std::mutex> lock(_unacked_mutex);
+    _stop.store(true);
+  }
+  _send_signal.raise();
   // Notify that SYN has been received to unblock sender.
   {
     std::lock_guard<std::mutex> lock(_syn_mutex);
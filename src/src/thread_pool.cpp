@@ -1,46 +1,122 @@
+#include <stdexcept>
 #include "thread_pool.hpp"
 
+std::atomic<size_t> ThreadPool::_threads_in_use{1};
+
+// Index of the calling thread's queue in the pool it works for.
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local size_t current_queue = 0;
+
 ThreadPool::ThreadPool(size_t num_threads) : _stop_threads(false) {
+  reserve_threads(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    _queues.push_back(std::make_unique<WorkQueue>());
+  }
   for (size_t i = 0; i < num_threads; ++i) {
-    _workers.emplace_back([this] { worker_function(); });
+    _workers.emplace_back([this, i] { worker_function(i); });
   }
 }
 
+// Fails instead of oversubscribing the process.
+void ThreadPool::reserve_threads(size_t n) {
+  size_t in_use = _threads_in_use.load();
+  do {
+    if (in_use + n > THREAD_BUDGET) {
+      throw std::runtime_error("ThreadPool exceeds the budget of " + std::to_string(THREAD_BUDGET) +
+                               " threads per process");
+    }
+  } while (!_threads_in_use.compare_exchange_weak(in_use, in_use + n));
+  _reserved += n;
+}
+
 void ThreadPool::stop() {
-  _stop_threads = true;
+  {
+    std::lock_guard<std::mutex> lock(_sleep_mutex);
+    _stop_threads = true;
+  }
   cv.notify_all();
   for (std::thread &worker : _workers) {
     if (worker.joinable())
       worker.join();
   }
+  // Pinned loops have to be told to return by their owner.
+  for (std::thread &thread : _pinned) {
+    if (thread.joinable())
+      thread.join();
+  }
+  _threads_in_use.fetch_sub(_reserved);
+  _reserved = 0;
 }
 
-void ThreadPool::enqueue(std::function<void()> task) {
+void ThreadPool::enqueue(Task task) {
+  if (_stop_threads) {
+    throw std::runtime_error("enqueue on stopped ThreadPool");
+  }
+  if (_queues.empty()) {
+    throw std::runtime_error("enqueue on a ThreadPool without task workers");
+  }
+  // Workers keep what they spawn, everybody else spreads tasks round robin.
+  size_t index = current_pool == this ? current_queue
+                                      : _next_queue.fetch_add(1) % _queues.size();
+  // Counted before it can be taken, so that _pending never drops below the
+  // tasks in the queues. A worker that wakes up in between finds nothing and
+  // checks again.
   {
-    std::unique_lock<std::mutex> lock(_queue_mutex);
-    if (_stop_threads) {
-      throw std::runtime_error("enqueue on stopped ThreadPool");
-    }
-    _task_queue.emplace(std::move(task));
+    std::lock_guard<std::mutex> lock(_sleep_mutex);
+    _pending.fetch_add(1);
+  }
+  {
+    std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+    _queues[index]->tasks.push_back(std::move(task));
   }
   cv.notify_one();
 }
 
-void ThreadPool::worker_function() {
-  while (true) {
-    std::function<void()> task;
+// Runs loop on a thread of its own for the lifetime of the pool.
+void ThreadPool::pin(Task loop) {
+  reserve_threads(1);
+  _pinned.emplace_back([loop = std::move(loop)]() mutable { loop(); });
+}
 
-    {
-      std::unique_lock<std::mutex> lock(_queue_mutex);
-      cv.wait(lock, [this] { return _stop_threads || !_task_queue.empty(); });
+bool ThreadPool::pop(size_t index, Task &task) {
+  WorkQueue &queue = *_queues[index];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty()) {
+    return false;
+  }
+  task = std::move(queue.tasks.back());
+  queue.tasks.pop_back();
+  return true;
+}
 
-      if (_stop_threads && _task_queue.empty())
-        return;
+bool ThreadPool::steal(size_t index, Task &task) {
+  for (size_t i = 1; i < _queues.size(); i++) {
+    WorkQueue &queue = *_queues[(index + i) % _queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
 
-      task = std::move(_task_queue.front());
-      _task_queue.pop();
+void ThreadPool::worker_function(size_t index) {
+  current_pool = this;
+  current_queue = index;
+  while (true) {
+    Task task;
+    if (pop(index, task) || steal(index, task)) {
+      _pending.fetch_sub(1);
+      task();
+      continue;
     }
 
-    task();
+    std::unique_lock<std::mutex> lock(_sleep_mutex);
+    cv.wait(lock, [this] { return _stop_threads || _pending > 0; });
+
+    if (_stop_threads && _pending == 0)
+      return;
   }
 }
@@ -1,4 +1,5 @@
 #include <string>
+#include <cassert>
 #include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
@@ -6,6 +7,113 @@
 #include <arpa/inet.h>
 #include "udp_socket.hpp"
 
+RecvBatch::RecvBatch(size_t batch_size, size_t slot_size)
+    : _slot_size(slot_size), _storage(batch_size * slot_size),
+      _iovecs(batch_size), _sources(batch_size), _msgs(batch_size) {
+  for (size_t i = 0; i < batch_size; i++) {
+    _iovecs[i].iov_base = _storage.data() + i * _slot_size;
+    _iovecs[i].iov_len = _slot_size;
+    _msgs[i].msg_hdr.msg_iov = &_iovecs[i];
+    _msgs[i].msg_hdr.msg_iovlen = 1;
+    _msgs[i].msg_hdr.msg_name = &_sources[i];
+  }
+}
+
+size_t RecvBatch::size() const {
+  return _msgs.size();
+}
+
+struct mmsghdr *RecvBatch::msgs() {
+  return _msgs.data();
+}
+
+const uint8_t *RecvBatch::data(size_t i) const {
+  return _storage.data() + i * _slot_size;
+}
+
+size_t RecvBatch::len(size_t i) const {
+  return _msgs[i].msg_len;
+}
+
+bool RecvBatch::truncated(size_t i) const {
+  return (_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+}
+
+const struct sockaddr_in& RecvBatch::source(size_t i) const {
+  return _sources[i];
+}
+
+// recvmmsg() overwrites msg_len, msg_namelen and msg_flags, everything else
+// stays valid.
+void RecvBatch::reset() {
+  for (auto& msg : _msgs) {
+    msg.msg_len = 0;
+    msg.msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_hdr.msg_flags = 0;
+  }
+}
+
+SendBatch::SendBatch(size_t max_datagrams, size_t arena_size)
+    : _arena(arena_size), _arena_used(0), _iovecs(max_datagrams),
+      _msgs(max_datagrams), _count(0), _next(0) {
+  for (size_t i = 0; i < max_datagrams; i++) {
+    _msgs[i].msg_hdr.msg_iov = &_iovecs[i];
+    _msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+uint8_t *SendBatch::tail() {
+  return _arena.data() + _arena_used;
+}
+
+size_t SendBatch::available() const {
+  return _arena.size() - _arena_used;
+}
+
+bool SendBatch::full() const {
+  return _count == _msgs.size();
+}
+
+// Queue the `len` bytes just written at tail() as one datagram for dest,
+// which has to stay valid until the datagram has been sent.
+void SendBatch::commit(size_t len, const struct sockaddr_in *dest) {
+  _iovecs[_count].iov_base = tail();
+  _iovecs[_count].iov_len = len;
+  _msgs[_count].msg_hdr.msg_name = const_cast<struct sockaddr_in *>(dest);
+  _msgs[_count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  _arena_used += len;
+  _count++;
+}
+
+// Append the `len` bytes just written at tail() to the last datagram queued,
+// which must not have been sent yet.
+void SendBatch::extend(size_t len) {
+  assert(_count > _next);
+  _iovecs[_count - 1].iov_len += len;
+  _arena_used += len;
+}
+
+size_t SendBatch::pending() const {
+  return _count - _next;
+}
+
+struct mmsghdr *SendBatch::pending_msgs() {
+  return _msgs.data() + _next;
+}
+
+void SendBatch::advance(size_t n) {
+  _next += n;
+  if (_next == _count) {
+    clear();
+  }
+}
+
+void SendBatch::clear() {
+  _arena_used = 0;
+  _count = 0;
+  _next = 0;
+}
+
 UDPSocket::UDPSocket(in_addr_t addr, uint16_t port) {
   // Create a non-blocking UDP socket.
   _outfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
@@ -21,17 +129,6 @@ UDPSocket::UDPSocket(in_addr_t addr, uint16_t port) {
   sock_addr.sin_port = port;
   sock_addr.sin_addr.s_addr = addr;
 
-  // Allow reusing the same address and port for multiple sockets.
-  int optval = 1;
-  if (setsockopt(_outfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) < 0) {
-    perror("setsockopt(SO_REUSEADDR) failed");
-    exit(EXIT_FAILURE);
-  }
-  if (setsockopt(_outfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) < 0) {
-    perror("setsockopt(SO_REUSEPORT) failed");
-    exit(EXIT_FAILURE);
-  }
-
   if (bind(_outfd, reinterpret_cast<struct sockaddr*>(&sock_addr), sizeof(sock_addr)) < 0) {
     perror("bind failed");
     exit(EXIT_FAILURE);
@@ -80,17 +177,40 @@ int UDPSocket::outfd() const {
   return _outfd;
 }
 
-void UDPSocket::conn(const struct sockaddr_in& addr) {
-  if (connect(_outfd, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) < 0) {
-    perror("connect failed");
+// Number of small datagrams the receive buffer can queue before the kernel
+// starts dropping them.
+size_t UDPSocket::recv_capacity() const {
+  int rcvbuf = 0;
+  socklen_t len = sizeof(rcvbuf);
+  if (getsockopt(_infd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) < 0) {
+    perror("getsockopt(SO_RCVBUF) failed");
     exit(EXIT_FAILURE);
   }
+  return static_cast<size_t>(rcvbuf) / RECV_DATAGRAM_TRUESIZE;
 }
 
-ssize_t UDPSocket::send_buf(const std::vector<uint8_t>& buffer) const {
-  return send(_outfd, buffer.data(), buffer.size(), 0);
+// The kernel caps the request at net.core.rmem_max.
+void UDPSocket::set_recv_buffer_size(int size) const {
+  if (setsockopt(_infd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+    perror("setsockopt(SO_RCVBUF) failed");
+    exit(EXIT_FAILURE);
+  }
 }
 
-ssize_t UDPSocket::recv_buf(std::vector<uint8_t>& buffer) const {
-  return recv(_infd, buffer.data(), buffer.size(), 0);
-}
\ No newline at end of file
+ssize_t UDPSocket::send_to(const uint8_t *buffer, size_t size, const struct sockaddr_in& dest) const {
+  return sendto(_outfd, buffer, size, 0, reinterpret_cast<const struct sockaddr*>(&dest), sizeof(dest));
+}
+
+int UDPSocket::recv_batch(RecvBatch& batch) const {
+  batch.reset();
+  return recvmmsg(_infd, batch.msgs(), static_cast<unsigned int>(batch.size()), 0, nullptr);
+}
+
+// Returns the number of datagrams sent, which may be less than pending().
+int UDPSocket::send_batch(SendBatch& batch) const {
+  int nsent = sendmmsg(_outfd, batch.pending_msgs(), static_cast<unsigned int>(batch.pending()), 0);
+  if (nsent > 0) {
+    batch.advance(static_cast<size_t>(nsent));
+  }
+  return nsent;
+}